@@ -0,0 +1,613 @@
+/* Class data sharing: -Xshare:dump writes the parsed and resolved metadata of
+   the program's classes into an archive, -Xshare:on maps it at startup and
+   uses it in place instead of reading the class files.
+
+   The archive is an image of the metadata as it would be in memory at the
+   address ARCHIVE_BASE. It is mapped there if that address is free, otherwise
+   every pointer listed in the relocation table is moved by the difference. The
+   mapping is private and writable, runtime state (init state, statics,
+   resolution cache, counters) lives in the same structures and only the pages
+   written to get copied. */
+
+#define ARCHIVE_MAGIC 0x41534a4e /* NJSA */
+#define ARCHIVE_BASE 0x500000000000ull
+
+struct Archive_Type {
+  String descriptor;
+  NType *type;
+};
+
+/* A file classes were loaded from when the archive was dumped, the archive is
+   only used while all of them are unchanged. Class files are compared by
+   content, jars by size and modification time. */
+struct Archive_Source {
+  String path;
+  u64 size;
+  s64 mtime;
+  /* Class::hash of a class file, 0 for jars */
+  u64 hash;
+};
+
+struct Archive_Header {
+  u32 magic;
+  char version[16];
+  /* address the archive was written for */
+  u64 base;
+  u64 size;
+
+  /* the class file or jar (and -main) the archive was dumped for, it is only
+     used when started the same way and the file didn't change since */
+  String source;
+  String main_option;
+  u64 source_size;
+  s64 source_mtime;
+  /* -cp, and the files all archived classes came from */
+  String class_path_option;
+  Array_View<Archive_Source> sources;
+
+  Class *main_class;
+  /* void, bool, byte, short, int, long */
+  NType *primitives[6];
+  Array_View<Class *> classes;
+  Array_View<String> symbols;
+  Array_View<Archive_Type> types;
+
+  /* offsets of the pointers to relocate, stored as offsets so they can be read
+     before relocating */
+  u64 relocations;
+  u64 relocation_count;
+};
+
+#ifndef _WIN32
+
+/* Copies metadata into an image based at ARCHIVE_BASE. The buffer is reserved
+   up front, so objects in it don't move while it is written. */
+struct Archive_Writer {
+  static const u64 CAPACITY = 1ull << 32;
+
+  u8 *buffer;
+  u64 size = 0;
+  /* pointer slots inside the buffer */
+  Array<void **> relocations;
+  /* original object -> its copy */
+  std::unordered_map<const void *, void *> copies;
+  /* original string data -> its copy */
+  std::unordered_map<const u8 *, String> strings;
+  Array<String> symbols;
+
+  Archive_Writer() {
+    buffer = (u8 *) mmap(0, CAPACITY, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (buffer == MAP_FAILED) {
+      printf("Failed to reserve memory for the archive\n");
+      exit(1);
+    }
+  }
+
+  ~Archive_Writer() {
+    munmap(buffer, CAPACITY);
+  }
+
+  /* zeroed, fresh pages of the reservation */
+  void *allocate(u64 length, u64 alignment = 8) {
+    size = (size + alignment - 1) & ~(alignment - 1);
+    if (size + length > CAPACITY) {
+      printf("Archive too big\n");
+      exit(1);
+    }
+
+    void *p = buffer + size;
+    size += length;
+    return p;
+  }
+
+  template<typename T>
+  T *allocate_array(u64 count) {
+    return (T *) allocate(count * sizeof(T), alignof(T));
+  }
+
+  template<typename T>
+  T *copy(T *original) {
+    T *c = allocate_array<T>(1);
+    memcpy((void *) c, (void *) original, sizeof(T));
+    copies[original] = c;
+    return c;
+  }
+
+  template<typename T>
+  void point(T **slot, T *target) {
+    *slot = target;
+    if (target) {
+      relocations.add((void **) slot);
+    }
+  }
+
+  template<typename T>
+  T *find_copy(T *original) {
+    auto it = copies.find(original);
+    return it == copies.end() ? 0 : (T *) it->second;
+  }
+
+  void write_string(String *slot, String s) {
+    *slot = s;
+    if (!s.data) {
+      return;
+    }
+
+    auto it = strings.find(s.data);
+    if (it == strings.end() || it->second.length < s.length) {
+      String c = s;
+      c.data = (u8 *) allocate(s.length, 1);
+      memcpy(c.data, s.data, s.length);
+      strings[s.data] = c;
+      if (s.interned) {
+        symbols.add(c);
+      }
+      it = strings.find(s.data);
+    }
+    point(&slot->data, it->second.data);
+  }
+
+  u8 *write_bytes(u8 *data, u64 length) {
+    u8 *c = (u8 *) allocate(length, 1);
+    memcpy(c, data, length);
+    return c;
+  }
+
+  /* Only the members that are used for the kind of type are written */
+  NType *write_type(NType *t) {
+    if (!t) {
+      return 0;
+    }
+    NType *c = find_copy(t);
+    if (c) {
+      return c;
+    }
+
+    c = allocate_array<NType>(1);
+    copies[t] = c;
+    c->type = t->type;
+
+    switch (t->type) {
+      case NType::CLASS:
+        write_string(&c->clazz_name, t->clazz_name);
+        break;
+      case NType::ARRAY:
+        point(&c->element_type, write_type(t->element_type));
+        break;
+      case NType::FUNCTION: {
+        NType **parameters = allocate_array<NType *>(t->parameters.length);
+        for (s64 i = 0; i < t->parameters.length; ++i) {
+          point(&parameters[i], write_type(t->parameters[i]));
+        }
+        point(&c->parameters.data, parameters);
+        c->parameters.length = t->parameters.length;
+        point(&c->return_type, write_type(t->return_type));
+      }
+        break;
+      default:
+        break;
+    }
+
+    return c;
+  }
+
+  void write_index(Member_Index *slot, Member_Index *index) {
+    u32 capacity = index->mask + 1;
+    point(&slot->hashes, (u64 *) write_bytes((u8 *) index->hashes, capacity * sizeof(u64)));
+    point(&slot->slots, (u16 *) write_bytes((u8 *) index->slots, capacity * sizeof(u16)));
+  }
+
+  /* Attributes stay undecoded, the block of count attributes at data is copied */
+  u8 *write_attributes(u8 *data, u16 count) {
+    Reader r(data, UINT32_MAX);
+    for (u16 i = 0; i < count; ++i) {
+      r.pos += 2;
+      r.pos += r.read_u32();
+    }
+    return write_bytes(data, r.pos);
+  }
+
+  template<typename T>
+  void write_member(T *c, T *original, Class *clazz) {
+    point(&c->clazz, clazz);
+    write_string(&c->name, original->name);
+    write_string(&c->descriptor, original->descriptor);
+    point(&c->type, write_type(original->type));
+    point(&c->attributes, original->attributes_count ? write_attributes(original->attributes, original->attributes_count) : (u8 *) 0);
+  }
+
+  Class *write_class(Class *original) {
+    Class *c = copy(original);
+    c->init_state = Class::UNINITIALIZED;
+    write_string(&c->name, original->name);
+    write_string(&c->super_name, original->super_name);
+
+    u16 cp_count = original->constant_pool_count - 1;
+    CP_Info *cp = allocate_array<CP_Info>(cp_count);
+    memcpy((void *) cp, (void *) original->constant_pool, cp_count * sizeof(CP_Info));
+    for (u16 i = 0; i < cp_count; ++i) {
+      if (cp[i].tag == CONSTANT_Utf8) {
+        write_string(&cp[i].utf8, original->constant_pool[i].utf8);
+      }
+    }
+    point(&c->constant_pool, cp);
+    /* filled in once all classes are written, see write_resolved() */
+    point(&c->resolved, allocate_array<void *>(cp_count));
+
+    Field *fields = allocate_array<Field>(original->fields_count);
+    for (u16 i = 0; i < original->fields_count; ++i) {
+      Field *f = &original->fields[i];
+      memcpy((void *) &fields[i], (void *) f, sizeof(Field));
+      copies[f] = &fields[i];
+      write_member(&fields[i], f, c);
+      fields[i].static_value = 0;
+    }
+    point(&c->fields, original->fields_count ? fields : 0);
+
+    Method *methods = allocate_array<Method>(original->methods_count);
+    for (u16 i = 0; i < original->methods_count; ++i) {
+      Method *m = &original->methods[i];
+      Method *a = &methods[i];
+      memcpy((void *) a, (void *) m, sizeof(Method));
+      copies[m] = a;
+      write_member(a, m, c);
+
+      /* the decoded Code points into the attributes, which moved */
+      if (m->code.code) {
+        intptr_t delta = a->attributes - m->attributes;
+        point(&a->code.code, m->code.code + delta);
+        point(&a->code.exception_table, m->code.exception_table + delta);
+        point(&a->code.attributes, m->code.attributes + delta);
+      }
+
+      a->instructions = 0;
+      a->invocation_count = 0;
+      a->backedge_count = 0;
+      a->compile_requested = false;
+      a->native_code = 0;
+      a->osr_entries = 0;
+    }
+    point(&c->methods, original->methods_count ? methods : 0);
+
+    write_index(&c->field_index, &original->field_index);
+    write_index(&c->method_index, &original->method_index);
+    return c;
+  }
+
+  /* Resolved entries point at other archived classes and members */
+  void write_resolved(Class *original) {
+    Class *c = find_copy(original);
+    for (u16 i = 0; i < original->constant_pool_count - 1; ++i) {
+      point(&c->resolved[i], original->resolved[i] ? find_copy(original->resolved[i]) : 0);
+    }
+  }
+
+  /* Turns the image into one based at ARCHIVE_BASE and writes it */
+  void finish(Archive_Header *header, const char *file_name) {
+    u64 *offsets = allocate_array<u64>(relocations.length);
+    header->relocations = (u8 *) offsets - buffer;
+    header->relocation_count = relocations.length;
+    header->base = ARCHIVE_BASE;
+    header->size = size;
+
+    for (s64 i = 0; i < relocations.length; ++i) {
+      void **slot = relocations[i];
+      *slot = (void *) ((u8 *) *slot - buffer + ARCHIVE_BASE);
+      offsets[i] = (u8 *) slot - buffer;
+    }
+
+    FILE *f = fopen(file_name, "wb");
+    if (!f || fwrite(buffer, 1, size, f) != size) {
+      printf("Failed to write archive '%s'\n", file_name);
+      exit(1);
+    }
+    fclose(f);
+  }
+};
+
+/* Loads everything the classes of the program refer to, resolves their
+   constant pools and decodes their code, so the archive holds the metadata as
+   it is once the program has run */
+struct Archive_Dumper : Backend {
+  Archive_Dumper(Class *main_class) : Backend(main_class) {}
+
+  void run() override {
+    /* loaded grows while resolving */
+    for (s64 i = 0; i < class_registry.loaded.length; ++i) {
+      clazz = class_registry.loaded[i];
+
+      for (u16 k = 1; k < clazz->constant_pool_count; ++k) {
+        switch (get_cp_info(k).tag) {
+          case CONSTANT_Class:
+            resolve_class(k);
+            break;
+          case CONSTANT_Fieldref:
+            resolve_field(k);
+            break;
+          case CONSTANT_Methodref:
+            resolve_method(k);
+            break;
+        }
+      }
+
+      for (u16 k = 0; k < clazz->methods_count; ++k) {
+        find_code(&clazz->methods[k]);
+      }
+    }
+  }
+};
+
+bool stat_source(const char *source, u64 *size, s64 *mtime) {
+  struct stat st;
+  if (stat(source, &st) < 0) {
+    return false;
+  }
+  *size = st.st_size;
+  *mtime = st.st_mtime;
+  return true;
+}
+
+/* The file c was loaded from, searched like ClassRegistry::load() does. The
+   main class comes from source. Returns 0 if it can't be found anymore. */
+char *find_class_source(Class *c, Class *main_class, const char *source, bool *is_jar) {
+  size_t length = strlen(source);
+  *is_jar = length > 4 && !strcmp(source + length - 4, ".jar");
+  if (c == main_class) {
+    return realpath(source, 0);
+  }
+
+  for (auto &e: class_registry.class_path) {
+    if (e.jar) {
+      String entry_name = c->name + to_string(".class");
+      Jar_Entry *entry = e.jar->find(entry_name);
+      free(entry_name.data);
+      if (entry) {
+        *is_jar = true;
+        return realpath(e.jar->file_name, 0);
+      }
+      continue;
+    }
+
+    String path = to_string(e.directory) + to_string("/") + c->name + to_string(".class");
+    char *file_name = to_c_string(path);
+    free(path.data);
+
+    char *real = realpath(file_name, 0);
+    free(file_name);
+    if (real) {
+      *is_jar = false;
+      return real;
+    }
+  }
+  return 0;
+}
+
+bool hash_file(const char *file_name, u64 *hash) {
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+
+  void *bytes = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (bytes == MAP_FAILED) {
+    return false;
+  }
+
+  *hash = hash_bytes(bytes, st.st_size);
+  munmap(bytes, st.st_size);
+  return true;
+}
+
+bool source_unchanged(Archive_Source &s) {
+  char *file_name = to_c_string(s.path);
+  u64 size;
+  s64 mtime;
+  u64 hash;
+  bool unchanged = stat_source(file_name, &size, &mtime) && size == s.size && mtime == s.mtime
+                   && (!s.hash || (hash_file(file_name, &hash) && hash == s.hash));
+  free(file_name);
+  return unchanged;
+}
+
+void dump_archive(Class *main_class, const char *file_name, const char *source, Options *options) {
+  Archive_Dumper dumper(main_class);
+  dumper.run();
+
+  Archive_Writer w;
+  Archive_Header *header = w.allocate_array<Archive_Header>(1);
+  header->magic = ARCHIVE_MAGIC;
+  strncpy(header->version, NJVM_VERSION, sizeof(header->version));
+  char *path = realpath(source, 0);
+  w.write_string(&header->source, to_string(path ? path : source));
+  if (options->main_class) {
+    w.write_string(&header->main_option, to_string(options->main_class));
+  }
+  stat_source(source, &header->source_size, &header->source_mtime);
+  if (options->class_path) {
+    w.write_string(&header->class_path_option, to_string(options->class_path));
+  }
+
+  /* classes of a jar share one entry */
+  Array<Archive_Source> sources;
+  Hash_Table<s64> jar_sources;
+  for (auto c: class_registry.loaded) {
+    bool is_jar;
+    char *class_source = find_class_source(c, main_class, source, &is_jar);
+    if (!class_source) {
+      printf("Can't find the class file of '%.*s' to archive\n", c->name.length, c->name.data);
+      exit(1);
+    }
+
+    String path = to_string(class_source);
+    if (is_jar && jar_sources.find(path)) {
+      continue;
+    }
+
+    Archive_Source s;
+    s.path = path;
+    s.hash = is_jar ? 0 : c->hash;
+    stat_source(class_source, &s.size, &s.mtime);
+    if (is_jar) {
+      jar_sources.insert(path, sources.length);
+    }
+    sources.add(s);
+  }
+  Archive_Source *archived_sources = w.allocate_array<Archive_Source>(sources.length);
+  for (s64 i = 0; i < sources.length; ++i) {
+    archived_sources[i] = sources[i];
+    w.write_string(&archived_sources[i].path, sources[i].path);
+  }
+  w.point(&header->sources.data, archived_sources);
+  header->sources.length = sources.length;
+
+  NType *primitives[6] = {type_void, type_bool, type_byte, type_short, type_int, type_long};
+  for (u16 i = 0; i < 6; ++i) {
+    w.point(&header->primitives[i], w.write_type(primitives[i]));
+  }
+
+  Array<Class *> &loaded = class_registry.loaded;
+  Class **classes = w.allocate_array<Class *>(loaded.length);
+  for (s64 i = 0; i < loaded.length; ++i) {
+    w.point(&classes[i], w.write_class(loaded[i]));
+  }
+  for (auto c: loaded) {
+    w.write_resolved(c);
+  }
+  w.point(&header->classes.data, classes);
+  header->classes.length = loaded.length;
+  w.point(&header->main_class, w.find_copy(main_class));
+
+  /* the types of the table keep their descriptors, later parses share them */
+  Array<Archive_Type> types;
+  for (s64 i = 0; i < type_table.types.capacity; ++i) {
+    auto &slot = type_table.types.slots[i];
+    if (slot.used) {
+      Archive_Type t;
+      t.descriptor = slot.key;
+      t.type = slot.value;
+      types.add(t);
+    }
+  }
+  Archive_Type *archived_types = w.allocate_array<Archive_Type>(types.length);
+  for (s64 i = 0; i < types.length; ++i) {
+    w.write_string(&archived_types[i].descriptor, types[i].descriptor);
+    w.point(&archived_types[i].type, w.write_type(types[i].type));
+  }
+  w.point(&header->types.data, archived_types);
+  header->types.length = types.length;
+
+  /* written last, every string of the archive has been copied by now */
+  String *symbols = w.allocate_array<String>(w.symbols.length);
+  for (s64 i = 0; i < w.symbols.length; ++i) {
+    symbols[i] = w.symbols[i];
+    w.point(&symbols[i].data, w.symbols[i].data);
+  }
+  w.point(&header->symbols.data, symbols);
+  header->symbols.length = w.symbols.length;
+
+  w.finish(header, file_name);
+  printf("Archived %lld classes to '%s' (%llu bytes)\n", (long long) loaded.length, file_name, (unsigned long long) w.size);
+}
+
+/* Maps the archive and registers its classes, returns the main class or 0 if
+   the archive can't be used for this program (then nothing was registered).
+   Has to run before anything is interned. */
+Class *map_archive(const char *file_name, const char *source, Options *options) {
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0) {
+    printf("Failed to open archive '%s', running without it\n", file_name);
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (u64) st.st_size < sizeof(Archive_Header)) {
+    close(fd);
+    printf("Archive '%s' is corrupt, running without it\n", file_name);
+    return 0;
+  }
+
+  u8 *base = (u8 *) mmap((void *) ARCHIVE_BASE, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    printf("Failed to map archive '%s', running without it\n", file_name);
+    return 0;
+  }
+
+  Archive_Header *header = (Archive_Header *) base;
+  if (header->magic != ARCHIVE_MAGIC || strncmp(header->version, NJVM_VERSION, sizeof(header->version)) || header->size != (u64) st.st_size) {
+    munmap(base, st.st_size);
+    printf("Archive '%s' was written by another version, running without it\n", file_name);
+    return 0;
+  }
+
+  /* only pages holding pointers are touched (and copied) */
+  u64 delta = (u64) base - header->base;
+  if (delta) {
+    u64 *offsets = (u64 *) (base + header->relocations);
+    for (u64 i = 0; i < header->relocation_count; ++i) {
+      *(u64 *) (base + offsets[i]) += delta;
+    }
+  }
+
+  u64 source_size;
+  s64 source_mtime;
+  char *path = realpath(source, 0);
+  String main_option = options->main_class ? to_string(options->main_class) : String();
+  String class_path_option = options->class_path ? to_string(options->class_path) : String();
+  if (!path || header->source != to_string(path) || header->main_option != main_option
+      || header->class_path_option != class_path_option
+      || !stat_source(source, &source_size, &source_mtime)
+      || source_size != header->source_size || source_mtime != header->source_mtime) {
+    munmap(base, st.st_size);
+    printf("Archive '%s' doesn't match '%s', running without it\n", file_name, source);
+    return 0;
+  }
+
+  for (auto &s: header->sources) {
+    if (!source_unchanged(s)) {
+      printf("Archive '%s' is out of date, '%.*s' changed, running without it\n", file_name, s.path.length, s.path.data);
+      munmap(base, st.st_size);
+      return 0;
+    }
+  }
+
+  type_void = header->primitives[0];
+  type_bool = header->primitives[1];
+  type_byte = header->primitives[2];
+  type_short = header->primitives[3];
+  type_int = header->primitives[4];
+  type_long = header->primitives[5];
+
+  for (auto s: header->symbols) {
+    symbol_table.add(s);
+  }
+  for (auto &t: header->types) {
+    type_table.types.insert(t.descriptor, t.type);
+  }
+  for (auto c: header->classes) {
+    class_registry.add(c);
+  }
+
+  return header->main_class;
+}
+
+#else
+
+void dump_archive(Class *main_class, const char *file_name, const char *source, Options *options) {
+  printf("Class data sharing is not supported on this platform\n");
+  exit(1);
+}
+
+Class *map_archive(const char *file_name, const char *source, Options *options) {
+  printf("Class data sharing is not supported on this platform, running without it\n");
+  return 0;
+}
+
+#endif
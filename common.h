@@ -4,6 +4,8 @@
 #include <assert.h>
 #include <cstdarg>
 #include <cstdio>
+#include <mutex>
+#include <new>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,6 +26,10 @@ typedef double f64;
 struct String {
 	u8 *data = 0;
 	u16 length = 0;
+	/* data is the unique copy of the bytes in the symbol table, see intern() */
+	bool interned = false;
+	/* hash_string() of interned strings */
+	u32 hash = 0;
 
 	String() {
 		data = 0;
@@ -45,6 +51,21 @@ struct String {
   }
 };
 
+/* FNV-1a */
+inline u64 hash_bytes(const void *data, u64 length, u64 seed = 0xcbf29ce484222325) {
+  const u8 *bytes = (const u8 *) data;
+  u64 hash = seed;
+  for (u64 i = 0; i < length; ++i) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+inline u32 hash_string(const String &s) {
+  return s.interned ? s.hash : (u32) hash_bytes(s.data, s.length);
+}
+
 inline String to_string(const char *c_string) {
   String s;
   s.data = (u8 *) c_string;
@@ -71,6 +92,8 @@ inline String operator+(const String &s, const String &t) {
 }
 
 inline bool operator==(const String &s, const String &t) {
+  /* there is only one copy of every interned string */
+  if (s.interned && t.interned) return s.data == t.data;
   if (s.length != t.length) return false;
   if (s.data == 0 && t.data != 0) return false;
   if (t.data == 0 && s.data != 0) return false;
@@ -268,4 +291,221 @@ struct Array {
   }
 };
 
-#endif
\ No newline at end of file
+/* Fixed size array in memory owned by someone else, e.g. an Arena */
+template<typename T>
+struct Array_View {
+  T *data = 0;
+  s64 length = 0;
+
+  T &operator[] (s64 index) {
+      assert(index >= 0 && index < length);
+      return data[index];
+  }
+
+  T *begin() {
+      return &data[0];
+  }
+
+  T *end() {
+      return &data[length];
+  }
+};
+
+/* Bump allocator. Memory is taken from blocks of BLOCK_SIZE bytes (big
+   requests get a block of their own) and only given back all at once by
+   release(). Not thread safe, every thread allocating needs its own arena. */
+struct Arena {
+  static const u64 BLOCK_SIZE = 64 * 1024;
+
+  Array<u8 *> blocks;
+  u8 *current = 0;
+  u8 *limit = 0;
+
+  ~Arena() {
+    release();
+  }
+
+  static u8 *align(u8 *p, u64 alignment) {
+    return (u8 *) (((uintptr_t) p + alignment - 1) & ~(uintptr_t) (alignment - 1));
+  }
+
+  void *allocate(u64 size, u64 alignment = 8) {
+    u8 *p = align(current, alignment);
+    if (current && p + size <= limit) {
+      current = p + size;
+      return p;
+    }
+
+    /* big requests don't throw away the rest of the current block */
+    if (size + alignment > BLOCK_SIZE / 4) {
+      u8 *block = (u8 *) malloc(size + alignment);
+      blocks.add(block);
+      return align(block, alignment);
+    }
+
+    u8 *block = (u8 *) malloc(BLOCK_SIZE);
+    blocks.add(block);
+    limit = block + BLOCK_SIZE;
+    p = align(block, alignment);
+    current = p + size;
+    return p;
+  }
+
+  /* zeroed memory for count elements of T, no constructors run */
+  template<typename T>
+  T *allocate_array(u64 count) {
+    void *p = allocate(count * sizeof(T), alignof(T));
+    memset(p, 0, count * sizeof(T));
+    return (T *) p;
+  }
+
+  template<typename T>
+  /* the memory is zeroed first, members without an initializer start out 0 */
+  T *make() {
+    void *p = allocate(sizeof(T), alignof(T));
+    memset(p, 0, sizeof(T));
+    return new (p) T();
+  }
+
+  void release() {
+    for (auto block: blocks) {
+      free(block);
+    }
+    blocks.reset();
+    current = 0;
+    limit = 0;
+  }
+};
+
+/* Open addressing hash table with String keys and linear probing. Keys are
+   not copied, the memory they point to has to outlive the table. */
+template<typename T>
+struct Hash_Table {
+  struct Slot {
+    String key;
+    u64 hash;
+    bool used;
+    T value;
+  };
+
+  Slot *slots = 0;
+  s64 capacity = 0;
+  s64 count = 0;
+
+  Hash_Table(s64 reserve_amount = 0) {
+    if (reserve_amount) {
+      reserve(reserve_amount);
+    }
+  }
+
+  ~Hash_Table() {
+    if (slots) free(slots);
+  }
+
+  static u64 hash_of(String key) {
+    return hash_string(key);
+  }
+
+  /* makes room for amount keys without growing */
+  void reserve(s64 amount) {
+    s64 new_capacity = 16;
+    while (new_capacity < amount * 2) {
+      new_capacity *= 2;
+    }
+    if (new_capacity <= capacity) return;
+
+    Slot *old_slots = slots;
+    s64 old_capacity = capacity;
+
+    slots = (Slot *) calloc(new_capacity, sizeof(Slot));
+    capacity = new_capacity;
+
+    for (s64 i = 0; i < old_capacity; ++i) {
+      if (old_slots[i].used) {
+        *probe(old_slots[i].key, old_slots[i].hash) = old_slots[i];
+      }
+    }
+
+    if (old_slots) free(old_slots);
+  }
+
+  /* slot holding key, or the empty slot it would go into */
+  Slot *probe(String key, u64 hash) const {
+    s64 mask = capacity - 1;
+    for (s64 i = hash & mask;; i = (i + 1) & mask) {
+      Slot *slot = &slots[i];
+      if (!slot->used || (slot->hash == hash && slot->key == key)) {
+        return slot;
+      }
+    }
+  }
+
+  T *find(String key) const {
+    if (!count) return 0;
+
+    Slot *slot = probe(key, hash_of(key));
+    return slot->used ? &slot->value : 0;
+  }
+
+  void clear() {
+    for (s64 i = 0; i < capacity; ++i) {
+      slots[i] = Slot{};
+    }
+    count = 0;
+  }
+
+  /* adds key or replaces its value */
+  T *insert(String key, T value) {
+    if ((count + 1) * 2 > capacity) {
+      reserve(count + 1);
+    }
+
+    u64 hash = hash_of(key);
+    Slot *slot = probe(key, hash);
+    if (!slot->used) {
+      slot->used = true;
+      slot->key = key;
+      slot->hash = hash;
+      count++;
+    }
+    slot->value = value;
+    return &slot->value;
+  }
+};
+
+/* Every distinct string of the loaded class files (names, descriptors, string
+   constants) exists once, with its hash computed up front. Classes are parsed
+   on several threads, so the table is locked. */
+struct Symbol_Table {
+  Hash_Table<String> symbols;
+  std::mutex lock;
+
+  String intern(String s) {
+    if (s.interned) return s;
+
+    std::lock_guard<std::mutex> guard(lock);
+    String *symbol = symbols.find(s);
+    if (symbol) return *symbol;
+
+    String copy = copy_string(s);
+    copy.hash = hash_string(s);
+    copy.interned = true;
+    symbols.insert(copy, copy);
+    return copy;
+  }
+
+  /* Adds an interned string whose bytes live elsewhere (in a mapped archive).
+     Only valid before the string was interned any other way. */
+  void add(String s) {
+    std::lock_guard<std::mutex> guard(lock);
+    symbols.insert(s, s);
+  }
+};
+
+inline Symbol_Table symbol_table;
+
+inline String intern(String s) {
+  return symbol_table.intern(s);
+}
+
+#endif
@@ -104,6 +104,7 @@ enum {
   OP_IF_ICMPLE = 0xa4,
 	OP_GOTO = 0xa7,
 	OP_IRETURN = 0xac,
+	OP_ARETURN = 0xb0,
 	OP_RETURN = 0xb1,
 	OP_GETSTATIC = 0xb2,
   OP_PUTSTATIC = 0xb3,
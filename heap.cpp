@@ -0,0 +1,343 @@
+/* The managed heap Java arrays live in. Threads take allocation buffers
+   (TLABs) from the nursery, allocating inside of a TLAB is a pointer bump and
+   a limit compare, which compiled code does inline (see
+   jit::Translator::allocate_array()). Only taking a new buffer goes through
+   the runtime. Buffers are zeroed when handed out, so new arrays are.
+
+   Once the nursery is full it is collected by copying the arrays that are
+   still reachable into the old space (all survivors are promoted at once).
+   The old space is collected by mark-compact when it can't take the next
+   promotion. Arrays only hold primitives, so the roots are all there is to
+   trace and no write barrier is needed: the frames of the interpreter, the
+   shadow stack of compiled code and static fields. Java code runs on one
+   thread, so collections happen on it and nothing else is stopped. */
+
+#define TLAB_SIZE (256 * 1024)
+/* bigger objects are allocated in the old space directly */
+#define TLAB_MAX_OBJECT (TLAB_SIZE / 4)
+#define NURSERY_SIZE (8 * 1024 * 1024)
+
+/* Array_Object::flags */
+enum {
+  /* the header word is the address of the copy, or'ed with this */
+  GC_FORWARDED = 1,
+  GC_MARKED = 2,
+};
+
+/* Compiled code accesses top and end directly */
+struct Tlab {
+  u8 *top = 0;
+  u8 *end = 0;
+};
+
+/* A frame of compiled code with roots, pushed and popped by the shadow stack
+   lowering of LLVM. The roots follow the entry. */
+struct Frame_Map {
+  s32 root_count;
+  s32 meta_count;
+};
+
+struct Stack_Entry {
+  Stack_Entry *next;
+  Frame_Map *map;
+
+  void **roots() {
+    return (void **) (this + 1);
+  }
+};
+
+/* the llvm_gc_root_chain of compiled code, see jit::Jit */
+Stack_Entry *gc_root_chain = 0;
+
+typedef void (*Root_Visitor)(Array_Object **slot);
+
+/* Everything on the heap is 8 byte aligned */
+inline u64 array_size(s64 length, u8 type) {
+  return (sizeof(Array_Object) + length * array_type_size(type) + 7) & ~7ull;
+}
+
+struct Heap;
+/* the visitors of the collector are plain functions */
+extern Heap heap;
+
+struct Heap {
+  /* whole heap, nursery included */
+  u64 size = 1024ull * 1024 * 1024;
+  bool verbose = false;
+
+  u8 *start = 0;
+  /* the nursery is at the start, TLABs are taken from nursery_top */
+  u8 *nursery_top = 0;
+  u8 *nursery_end = 0;
+  u8 *old_top = 0;
+  u8 *end = 0;
+  std::mutex lock;
+
+  /* Visits the arrays in the frames of the interpreter, set by it */
+  std::function<void(Root_Visitor)> scan_frames;
+
+  struct Forwarding {
+    u8 *from;
+    u8 *to;
+  };
+
+  /* new addresses of the arrays moved by the last mark-compact, by address */
+  Array<Forwarding> moved;
+
+  void reserve() {
+    u64 nursery_size = size / 4 < NURSERY_SIZE ? size / 4 & ~(u64) (TLAB_SIZE - 1) : NURSERY_SIZE;
+    if (nursery_size < TLAB_SIZE) {
+      printf("Heap too small\n");
+      exit(1);
+    }
+
+#ifdef _WIN32
+    /* no overcommit, the heap is committed up front */
+    start = (u8 *) malloc(size);
+    if (!start) {
+#else
+    start = (u8 *) mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (start == MAP_FAILED) {
+#endif
+      printf("Failed to reserve the heap\n");
+      exit(1);
+    }
+
+    nursery_top = start;
+    nursery_end = start + nursery_size;
+    old_top = nursery_end;
+    end = start + size;
+  }
+
+  bool in_nursery(void *p) {
+    return p >= start && p < nursery_end;
+  }
+
+  bool in_old(void *p) {
+    return p >= nursery_end && p < old_top;
+  }
+
+  /* Slow path of an allocation that didn't fit into the TLAB */
+  void *allocate(Tlab *tlab, u64 size) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!start) {
+      reserve();
+    }
+
+    if (size > TLAB_MAX_OBJECT) {
+      return allocate_old(size);
+    }
+
+    /* the rest of the old buffer is left unused */
+    if (nursery_top == nursery_end) {
+      collect_young(tlab);
+    }
+
+    tlab->top = nursery_top;
+    tlab->end = nursery_top + TLAB_SIZE;
+    nursery_top += TLAB_SIZE;
+    memset(tlab->top, 0, TLAB_SIZE);
+
+    void *p = tlab->top;
+    tlab->top += size;
+    return p;
+  }
+
+  u8 *allocate_old(u64 size) {
+    if (size > (u64) (end - old_top)) {
+      collect_old();
+      if (size > (u64) (end - old_top)) {
+        out_of_memory();
+      }
+    }
+
+    u8 *p = old_top;
+    old_top += size;
+    memset(p, 0, size);
+    return p;
+  }
+
+  void out_of_memory() {
+    printf("Out of memory, use -heap-size to give the program more than %lluMB\n", (unsigned long long) (size >> 20));
+    exit(1);
+  }
+
+  void visit_roots(Root_Visitor visit) {
+    if (scan_frames) {
+      scan_frames(visit);
+    }
+
+    for (Stack_Entry *e = gc_root_chain; e; e = e->next) {
+      for (s32 i = 0; i < e->map->root_count; ++i) {
+        visit((Array_Object **) &e->roots()[i]);
+      }
+    }
+
+    /* compile threads may load classes meanwhile */
+    std::lock_guard<std::recursive_mutex> guard(class_registry.lock);
+    for (auto c: class_registry.loaded) {
+      for (u16 i = 0; i < c->fields_count; ++i) {
+        Field *f = &c->fields[i];
+        if (f->type->type == NType::ARRAY) {
+          visit((Array_Object **) &f->static_value);
+        }
+      }
+    }
+  }
+
+  /* Promotes everything reachable in the nursery, which is empty afterwards.
+     The old space has to be able to take the whole nursery. */
+  void collect_young(Tlab *tlab) {
+    auto begin = std::chrono::steady_clock::now();
+
+    u64 used = nursery_top - start;
+    if (used > (u64) (end - old_top)) {
+      collect_old();
+      if (used > (u64) (end - old_top)) {
+        out_of_memory();
+      }
+    }
+
+    u8 *old_before = old_top;
+    visit_roots(evacuate);
+    nursery_top = start;
+    tlab->top = 0;
+    tlab->end = 0;
+
+    if (verbose) {
+      double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+      printf("[GC young %lluK -> %lluK promoted, old %lluK, %.3fms]\n", (unsigned long long) (used >> 10),
+             (unsigned long long) ((old_top - old_before) >> 10), (unsigned long long) ((old_top - nursery_end) >> 10), ms);
+    }
+  }
+
+  static void evacuate(Array_Object **slot) {
+    Array_Object *a = *slot;
+    if (!heap.in_nursery(a)) {
+      return;
+    }
+
+    u64 header = *(u64 *) a;
+    if (header & GC_FORWARDED) {
+      *slot = (Array_Object *) (header & ~(u64) GC_FORWARDED);
+      return;
+    }
+
+    u64 size = array_size(a->length, a->type);
+    Array_Object *copy = (Array_Object *) heap.old_top;
+    heap.old_top += size;
+    memcpy(copy, a, size);
+
+    *(u64 *) a = (u64) copy | GC_FORWARDED;
+    *slot = copy;
+  }
+
+  /* Mark-compact of the old space: marks what the roots reach, slides the
+     marked arrays down in address order and updates the roots. Roots into
+     the nursery are left alone. */
+  void collect_old() {
+    auto begin = std::chrono::steady_clock::now();
+    u8 *old_before = old_top;
+
+    visit_roots(mark);
+
+    moved.reset();
+    u8 *to = nursery_end;
+    for (u8 *p = nursery_end; p < old_top;) {
+      Array_Object *a = (Array_Object *) p;
+      u64 size = array_size(a->length, a->type);
+      if (a->flags & GC_MARKED) {
+        moved.add({p, to});
+        to += size;
+      }
+      p += size;
+    }
+
+    visit_roots(update);
+
+    for (auto &f: moved) {
+      Array_Object *a = (Array_Object *) f.from;
+      a->flags &= ~GC_MARKED;
+      memmove(f.to, f.from, array_size(a->length, a->type));
+    }
+    old_top = to;
+
+#ifndef _WIN32
+    /* the pages that are free now go back to the system */
+    u64 page = sysconf(_SC_PAGESIZE);
+    u8 *unused = (u8 *) (((u64) old_top + page - 1) & ~(page - 1));
+    if (unused < old_before) {
+      madvise(unused, old_before - unused, MADV_DONTNEED);
+    }
+#endif
+
+    if (verbose) {
+      double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+      printf("[GC old %lluK -> %lluK, %.3fms]\n", (unsigned long long) ((old_before - nursery_end) >> 10),
+             (unsigned long long) ((old_top - nursery_end) >> 10), ms);
+    }
+  }
+
+  static void mark(Array_Object **slot) {
+    if (heap.in_old(*slot)) {
+      (*slot)->flags |= GC_MARKED;
+    }
+  }
+
+  static void update(Array_Object **slot) {
+    u8 *p = (u8 *) *slot;
+    if (!heap.in_old(p)) {
+      return;
+    }
+
+    s64 low = 0;
+    s64 high = heap.moved.length - 1;
+    while (low <= high) {
+      s64 mid = (low + high) / 2;
+      if (heap.moved[mid].from == p) {
+        *slot = (Array_Object *) heap.moved[mid].to;
+        return;
+      }
+      if (heap.moved[mid].from < p) {
+        low = mid + 1;
+      } else {
+        high = mid - 1;
+      }
+    }
+  }
+};
+
+Heap heap;
+thread_local Tlab tlab;
+
+/* The same fast path compiled code inlines */
+inline void *heap_allocate(u64 size) {
+  if (size <= TLAB_MAX_OBJECT && size <= (u64) (tlab.end - tlab.top)) {
+    void *p = tlab.top;
+    tlab.top += size;
+    return p;
+  }
+  return heap.allocate(&tlab, size);
+}
+
+extern "C" {
+/* The TLAB of the calling thread, compiled code can't access thread_locals
+   directly */
+Tlab *njvm_current_tlab() {
+  return &tlab;
+}
+
+/* Allocates a zeroed array of length elements of type (TYPE_*), see
+   Array_Object. May collect, compiled code spills its roots around calls. */
+Array_Object *new_array(s64 length, s64 type) {
+  if (length < 0) {
+    printf("Negative array size %lld\n", (long long) length);
+    exit(1);
+  }
+
+  Array_Object *array = (Array_Object *) heap_allocate(array_size(length, type));
+  array->type = type;
+  array->length = length;
+  return array;
+}
+}
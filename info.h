@@ -31,12 +31,18 @@ struct Attribute {
 	u8 *info;
 };
 
+/* Decoded on first use, see Backend::find_code(). Everything points into the
+   class data, the exception table and the attributes of the code (e.g.
+   LineNumberTable) are left undecoded since nothing uses them yet. */
 struct Code {
 	u16 max_stack;
 	u16 max_locals;
 	u32 code_length;
 	u8 *code;
-	/* TODO: complete */
+	u16 exception_table_length;
+	u8 *exception_table;
+	u16 attributes_count;
+	u8 *attributes;
 };
 
 struct NType {
@@ -57,48 +63,171 @@ struct NType {
   String clazz_name;
   NType *element_type;
 
-	Array<NType *> parameters;
+	Array_View<NType *> parameters;
   NType *return_type;
 
   NType() {}
 };
 
+/* Runtime layout of an array, the elements follow the header. Arrays are
+   passed around as a pointer to the header, by both backends, so the length
+   goes wherever the array goes (arguments, results, fields) */
+struct Array_Object {
+  /* reserved for the garbage collector */
+  u8 flags;
+  /* TYPE_* of the elements */
+  u8 type;
+  u16 reserved;
+  s32 length;
+
+  u8 *data() {
+    return (u8 *) (this + 1);
+  }
+};
+
+static_assert(sizeof(Array_Object) == 8, "compiled code assumes the elements at offset 8");
+
+/* Slot kinds of an OSR entry, arrays also carry their element type */
+enum {
+  OSR_NONE = 0,
+  OSR_INT = 1,
+  OSR_ARRAY = 0x80,
+};
+
+/* Compiled code entering a method at the loop header at offset. It takes the
+   interpreter frame as one word per slot (value or Array_Object pointer),
+   locals first, and is only valid for frames of the shape it was compiled for */
+struct Osr_Entry {
+  u16 offset;
+  u8 *shape;
+  u16 shape_length;
+  void *code = 0;
+  Osr_Entry *next = 0;
+};
+
+namespace interp {
+  struct Instruction;
+}
+
 struct Class;
 struct Method {
   Class *clazz;
 	u16 access_flags;
 	String name;
+	String descriptor;
   NType *type;
 	u16 attributes_count;
-	Attribute *attributes;
+	/* undecoded, see Backend::find_attribute() */
+	u8 *attributes;
 
   Code code = {0};
-
-  /* remove later? */
-  llvm::Function *llvm_ref;
+  /* code in the interpreter's pre-decoded form, see interp::Interpreter::decode() */
+  interp::Instruction *instructions = 0;
+
+  /* Tiered execution: the interpreter counts calls and loop back edges, once they
+     cross the threshold the method is compiled in the background and calls go
+     to native_code (the i2c adapter of the method) from then on */
+  u32 invocation_count = 0;
+  u32 backedge_count = 0;
+  bool compile_requested = false;
+  void *native_code = 0;
+  /* loop headers the interpreter asked to enter compiled code at */
+  Osr_Entry *osr_entries = 0;
 };
 
 struct Field {
+  Class *clazz;
 	u16 access_flags;
 	String name;
+	String descriptor;
   NType *type;
 	u16 attributes_count;
-	Attribute *attributes;
+	/* undecoded, see Backend::find_attribute() */
+	u8 *attributes;
 
-  /* remove later? */
-  llvm::GlobalVariable *llvm_ref;
+	/* storage of static fields, shared by interpreter and compiled code */
+	u64 static_value = 0;
+};
+
+/* Open addressing index of the methods or fields of a class by name and
+   descriptor, built once when the class is read. Slots hold the position of the
+   member + 1, 0 marks an empty slot. */
+struct Member_Index {
+  u64 *hashes = 0;
+  u16 *slots = 0;
+  u32 mask = 0;
+
+  static u64 hash(String name, String descriptor) {
+    return (u64) hash_string(name) * 0x9e3779b97f4a7c15 ^ hash_string(descriptor);
+  }
+
+  template<typename T>
+  void build(T *members, u16 count, Arena *arena) {
+    u32 capacity = 4;
+    while (capacity < (u32) count * 2) {
+      capacity *= 2;
+    }
+    mask = capacity - 1;
+    hashes = arena->allocate_array<u64>(capacity);
+    slots = arena->allocate_array<u16>(capacity);
+
+    for (u16 i = 0; i < count; ++i) {
+      u64 h = hash(members[i].name, members[i].descriptor);
+      u32 s = h & mask;
+      while (slots[s]) {
+        s = (s + 1) & mask;
+      }
+      hashes[s] = h;
+      slots[s] = i + 1;
+    }
+  }
+
+  template<typename T>
+  T *find(T *members, String name, String descriptor) const {
+    u64 h = hash(name, descriptor);
+    for (u32 s = h & mask; slots[s]; s = (s + 1) & mask) {
+      T *m = &members[slots[s] - 1];
+      if (hashes[s] == h && m->name == name && m->descriptor == descriptor) {
+        return m;
+      }
+    }
+    return 0;
+  }
 };
 
 struct Class {
+	/* hash of the class file bytes */
+	u64 hash;
 	u16 access_flags;
 	String name;
 	String super_name;
 	u16 constant_pool_count;
 	CP_Info *constant_pool;
+	/* parallel to constant_pool: the Method, Field or Class an entry resolved to,
+	   see Backend::resolve_method() */
+	void **resolved;
 	u16 methods_count;
 	Method *methods;
 	u16 fields_count;
 	Field *fields;
+	Member_Index method_index;
+	Member_Index field_index;
+
+	Method *find_method(String name, String descriptor) {
+	  return method_index.find(methods, name, descriptor);
+	}
+
+	Field *find_field(String name, String descriptor) {
+	  return field_index.find(fields, name, descriptor);
+	}
+
+	/* <clinit> runs on first active use, see ClassRegistry::initialize() */
+	enum Init_State : u8 {
+	  UNINITIALIZED,
+	  INITIALIZING,
+	  INITIALIZED,
+	};
+	Init_State init_state = UNINITIALIZED;
 };
 
 /* TODO: cleanup. Don't really want them to stay globally for ever */
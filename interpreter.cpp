@@ -1,10 +1,108 @@
+#ifndef NJVM_COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define NJVM_COMPUTED_GOTO 1
+#else
+#define NJVM_COMPUTED_GOTO 0
+#endif
+#endif
+
+/* Forms the interpreter rewrites instructions into, see Interpreter::decode()
+   and Interpreter::quicken(). They use opcodes the JVM leaves unassigned. */
+enum {
+  QUICK_ICONST = 0xcb,
+  QUICK_LDC_STRING,
+  QUICK_GETSTATIC,
+  QUICK_GETSTATIC_REF,
+  QUICK_PUTSTATIC,
+  QUICK_INVOKE,
+  QUICK_PRINTLN,
+  QUICK_NEW,
+  QUICK_NOP,
+};
+
+/* every opcode with a handler in Interpreter::execute() */
+#define INTERPRETER_OPCODES(X) \
+  X(QUICK_ICONST) \
+  X(QUICK_LDC_STRING) \
+  X(OP_ILOAD) \
+  X(OP_ISTORE) \
+  X(OP_IALOAD) \
+  X(OP_LALOAD) \
+  X(OP_BALOAD) \
+  X(OP_SALOAD) \
+  X(OP_IASTORE) \
+  X(OP_LASTORE) \
+  X(OP_BASTORE) \
+  X(OP_SASTORE) \
+  X(OP_POP) \
+  X(OP_DUP) \
+  X(OP_IADD) \
+  X(OP_ISUB) \
+  X(OP_IMUL) \
+  X(OP_IDIV) \
+  X(OP_IREM) \
+  X(OP_ISHL) \
+  X(OP_ISHR) \
+  X(OP_IAND) \
+  X(OP_IOR) \
+  X(OP_INEG) \
+  X(OP_IINC) \
+  X(OP_IFEQ) \
+  X(OP_IFNE) \
+  X(OP_IFLT) \
+  X(OP_IFGE) \
+  X(OP_IFGT) \
+  X(OP_IFLE) \
+  X(OP_IF_ICMPEQ) \
+  X(OP_IF_ICMPNE) \
+  X(OP_IF_ICMPLT) \
+  X(OP_IF_ICMPGE) \
+  X(OP_IF_ICMPGT) \
+  X(OP_IF_ICMPLE) \
+  X(OP_GOTO) \
+  X(OP_IRETURN) \
+  X(OP_ARETURN) \
+  X(OP_RETURN) \
+  X(QUICK_GETSTATIC) \
+  X(QUICK_GETSTATIC_REF) \
+  X(QUICK_PUTSTATIC) \
+  X(QUICK_INVOKE) \
+  X(QUICK_PRINTLN) \
+  X(QUICK_NEW) \
+  X(QUICK_NOP) \
+  X(OP_GETSTATIC) \
+  X(OP_PUTSTATIC) \
+  X(OP_INVOKEVIRTUAL) \
+  X(OP_INVOKESPECIAL) \
+  X(OP_INVOKESTATIC) \
+  X(OP_NEW) \
+  X(OP_NEWARRAY) \
+  X(OP_ARRAYLENGTH)
+
+#if NJVM_COMPUTED_GOTO
+#define OPCODE(op) op_##op:
+#define OPCODE_DEFAULT op_default:
+#define NEXT() do { inst = pc++; opcode = inst->opcode; goto *dispatch[opcode]; } while (0)
+#else
+#define OPCODE(op) case op:
+#define OPCODE_DEFAULT default:
+#define NEXT() continue
+#endif
+
 namespace interp {
+  struct Static_Ref {
+    String clazz;
+    String member;
+  };
+
   struct Value {
     enum Value_Type {
+      NONE,
       INT,
       STRING,
       TYPE,
       OBJECT,
+      ARRAY,
     };
 
     Value_Type type;
@@ -12,11 +110,8 @@ namespace interp {
     union {
         String utf8;
         long int int_value;
-
-        struct {
-            String clazz;
-            String member;
-        };
+        Static_Ref ref;
+        Array_Object *array;
     };
 
     Value() {}
@@ -32,104 +127,219 @@ namespace interp {
 
   Value make_object(String utf8);
 
+  Value make_array(Array_Object *array);
+
+  /* Pre-decoded instruction, fixed width so the interpreter never parses
+     bytecode while running */
+  struct Instruction {
+    u8 opcode;
+    /* bytecode offset, OSR entries are keyed by it */
+    u16 offset;
+    /* local index, branch target (instruction index), array type, constant pool
+       index of unquickened instructions or the receiver flag of QUICK_INVOKE */
+    u32 operand;
+    union {
+      s64 value;
+      Method *method;
+      Field *field;
+      String *utf8;
+      Static_Ref *ref;
+    };
+  };
+
+  struct Frame_Chunk {
+    Value *base;
+    Value *limit;
+    /* end of the frames in the chunk while later chunks are in use */
+    Value *used;
+  };
+
+  /* Position in a Frame_Stack to return to once a frame is done */
+  struct Frame_Mark {
+    Value *top;
+    s64 chunk;
+  };
+
+  /* Locals and operand stacks of the interpreted frames of one thread. Frames are
+     bump allocated and released in LIFO order. Chunks never move, so pointers into
+     frames stay valid; a frame that doesn't fit into the current chunk starts the
+     next one. Chunks are kept around for the next deep call chain. */
+  struct Frame_Stack {
+    static const s64 CHUNK_SLOTS = 64 * 1024;
+
+    Array<Frame_Chunk> chunks;
+    s64 chunk = -1;
+    Value *top = 0;
+    Value *limit = 0;
+
+    Frame_Mark mark() {
+      return {top, chunk};
+    }
+
+    void release(Frame_Mark m) {
+      top = m.top;
+      chunk = m.chunk;
+      limit = chunk >= 0 ? chunks[chunk].limit : 0;
+    }
+
+    /* Returns size slots, the first arg_count of which are the values at args.
+       Those are the top of the caller's operand stack, normally the frame just
+       starts there so the arguments become its first locals without copying. */
+    Value *allocate(Value *args, u32 arg_count, u32 size) {
+      if (args && args + size <= limit) {
+        top = args + size;
+        return args;
+      }
+
+      if (chunk >= 0) {
+        chunks[chunk].used = top;
+      }
+      chunk++;
+      if (chunk == chunks.length || chunks[chunk].limit - chunks[chunk].base < size) {
+        s64 slots = size > CHUNK_SLOTS ? size : CHUNK_SLOTS;
+        Frame_Chunk c{};
+        c.base = (Value *) malloc(slots * sizeof(Value));
+        c.limit = c.base + slots;
+
+        if (chunk == chunks.length) {
+          chunks.add(c);
+        } else {
+          free(chunks[chunk].base);
+          chunks[chunk] = c;
+        }
+      }
+
+      Value *frame = chunks[chunk].base;
+      memcpy(frame, args, arg_count * sizeof(Value));
+      top = frame + size;
+      limit = chunks[chunk].limit;
+      return frame;
+    }
+
+    /* The arrays in all frames are roots of the collector. Every slot of a
+       frame is initialized when it is entered, so the slots above sp only hold
+       stale values that are still valid. */
+    void visit_roots(Root_Visitor visit) {
+      for (s64 i = 0; i <= chunk; ++i) {
+        Value *end = i == chunk ? top : chunks[i].used;
+        for (Value *v = chunks[i].base; v < end; ++v) {
+          if (v->type == Value::ARRAY) {
+            visit(&v->array);
+          }
+        }
+      }
+    }
+  };
+
+  thread_local Frame_Stack frame_stack;
+
   struct Call_Frame {
     Class *clazz;
     Method *method;
     Value *stack;
     Value *locals;
-    u8 *ip;
+    Instruction *pc;
     u8 sp;
+    Frame_Mark mark;
   };
 
   struct Interpreter : Backend {
-    Value *stack;
-    Value *locals;
+    /* the current frame, both point into frame_stack */
+    Value *stack = 0;
+    Value *locals = 0;
+    Instruction *pc = 0;
+
+    Options *options;
+    /* set in tiered mode, hot methods are handed to it for compilation */
+    jit::Jit *jit;
 
-    Interpreter(Class *main_clazz) : Backend(main_clazz) {
+    Interpreter(Class *main_clazz, Options *options, jit::Jit *jit = 0) : Backend(main_clazz) {
+      this->options = options;
+      this->jit = jit;
+      heap.scan_frames = [](Root_Visitor visit) { frame_stack.visit_roots(visit); };
     }
 
     void run() override {
-        Method *main_method = find_method("main");
+        class_registry.run_initializer = [this](Method *m) { call_main(m); };
+        class_registry.initialize(clazz);
+
+        Method *main_method = find_main();
         call_main(main_method);
     }
 
-    bool execute() {
-      u8 opcode = fetch_u8();
+    /* Runs the current frame until it returns. With NJVM_COMPUTED_GOTO every
+       handler jumps straight to the next one through the dispatch table, the
+       portable build uses a switch inside a loop. */
+    void execute() {
+      Instruction *inst;
+      u8 opcode;
 
-      switch (opcode) {
-        case OP_ICONST_0:
-        case OP_ICONST_1:
-        case OP_ICONST_2:
-        case OP_ICONST_3:
-        case OP_ICONST_4:
-        case OP_ICONST_5: {
-          push(make_int(opcode - 3));
-        } break;
-        case OP_BIPUSH: {
-          push(make_int(fetch_u8()));
-        } break;
-        case OP_SIPUSH: {
-          push(make_int(fetch_u16()));
-        } break;
-        case OP_LDC: {
-          u8 const_index = fetch_u8();
-          CP_Info cnst = get_cp_info(const_index + 1);
+#if NJVM_COMPUTED_GOTO
+      static void *dispatch[256];
+      if (!dispatch[0]) {
+        for (u16 i = 0; i < 256; ++i) {
+          dispatch[i] = &&op_default;
+        }
+#define SET_HANDLER(op) dispatch[op] = &&op_##op;
+        INTERPRETER_OPCODES(SET_HANDLER)
+#undef SET_HANDLER
+      }
 
-          push(make_string(cnst.utf8));
-        } break;
-        case OP_ILOAD: {
-          load(fetch_u8());
-        } break;
-        case OP_ALOAD: {
-          load(fetch_u8());
-        } break;
-        case OP_ALOAD_0:
-        case OP_ALOAD_1:
-        case OP_ALOAD_2:
-        case OP_ALOAD_3: {
-          load(opcode - 0x2a);
-        } break;
-        case OP_ASTORE: {
-          store(fetch_u8());
-        } break;
-        case OP_ASTORE_0:
-        case OP_ASTORE_1:
-        case OP_ASTORE_2:
-        case OP_ASTORE_3: {
-          store(opcode - 0x4b);
-        } break;
-        case OP_ILOAD_0:
-        case OP_ILOAD_1:
-        case OP_ILOAD_2:
-        case OP_ILOAD_3: {
-          load(opcode - 0x1a);
-        } break;
-        case OP_ISTORE: {
-          store(fetch_u8());
-        } break;
-        case OP_ISTORE_0:
-        case OP_ISTORE_1:
-        case OP_ISTORE_2:
-        case OP_ISTORE_3: {
-          store(opcode - 0x3b);
-        } break;
-        case OP_POP: {
+      NEXT();
+#else
+      for (;;) {
+      inst = pc++;
+      opcode = inst->opcode;
+      switch (opcode) {
+#endif
+        OPCODE(QUICK_ICONST) {
+          push(make_int(inst->value));
+        } NEXT();
+        OPCODE(QUICK_LDC_STRING) {
+          push(make_string(*inst->utf8));
+        } NEXT();
+        OPCODE(OP_ILOAD) {
+          load(inst->operand);
+        } NEXT();
+        OPCODE(OP_ISTORE) {
+          store(inst->operand);
+        } NEXT();
+        OPCODE(OP_IALOAD)
+        OPCODE(OP_LALOAD)
+        OPCODE(OP_BALOAD)
+        OPCODE(OP_SALOAD) {
+          long int index = pop().int_value;
+          Array_Object *arr = pop().array;
+          push(make_int(array_load(arr, index)));
+        } NEXT();
+        OPCODE(OP_IASTORE)
+        OPCODE(OP_LASTORE)
+        OPCODE(OP_BASTORE)
+        OPCODE(OP_SASTORE) {
+          long int val = pop().int_value;
+          long int index = pop().int_value;
+          Array_Object *arr = pop().array;
+          array_store(arr, index, val);
+        } NEXT();
+        OPCODE(OP_POP) {
           pop();
-        } break;
-        case OP_DUP: {
+        } NEXT();
+        OPCODE(OP_DUP) {
           Value val = pop();
           push(val);
           push(val);
-        } break;
-        case OP_IADD:
-        case OP_ISUB:
-        case OP_IMUL:
-        case OP_IDIV:
-        case OP_IREM:
-        case OP_ISHL:
-        case OP_ISHR: {
-          long int l = pop().int_value;
+        } NEXT();
+        OPCODE(OP_IADD)
+        OPCODE(OP_ISUB)
+        OPCODE(OP_IMUL)
+        OPCODE(OP_IDIV)
+        OPCODE(OP_IREM)
+        OPCODE(OP_ISHL)
+        OPCODE(OP_ISHR)
+        OPCODE(OP_IAND)
+        OPCODE(OP_IOR) {
           long int r = pop().int_value;
+          long int l = pop().int_value;
 
           switch (opcode) {
             case OP_IADD:
@@ -153,142 +363,614 @@ namespace interp {
             case OP_ISHR:
               push(make_int(l >> r));
               break;
+            case OP_IAND:
+              push(make_int(l & r));
+              break;
+            case OP_IOR:
+              push(make_int(l | r));
+              break;
           }
-        } break;
-        case OP_INEG: {
+        } NEXT();
+        OPCODE(OP_INEG) {
           Value v = pop();
           v.int_value = -v.int_value;
           push(v);
-        } break;
-        case OP_IINC: {
-          u8 index = fetch_u8();
-          locals[index].int_value++;
-        } break;
-        case OP_GOTO: {
-          u16 offset_u = fetch_u16();
-          s16 offset = (s16) offset_u;
+        } NEXT();
+        OPCODE(OP_IINC) {
+          locals[inst->operand].int_value += inst->value;
+        } NEXT();
+        OPCODE(OP_IFEQ)
+        OPCODE(OP_IFNE)
+        OPCODE(OP_IFLT)
+        OPCODE(OP_IFGE)
+        OPCODE(OP_IFGT)
+        OPCODE(OP_IFLE) {
+          long int val = pop().int_value;
+          bool taken = false;
 
-          ip += offset;
-        } break;
-        case OP_IRETURN:
-        case OP_RETURN: {
-          return true;
-        } break;
-        case OP_GETSTATIC: {
-          u16 field_index = fetch_u16();
+          switch (opcode) {
+            case OP_IFEQ:
+              taken = val == 0;
+              break;
+            case OP_IFNE:
+              taken = val != 0;
+              break;
+            case OP_IFLT:
+              taken = val < 0;
+              break;
+            case OP_IFGE:
+              taken = val >= 0;
+              break;
+            case OP_IFGT:
+              taken = val > 0;
+              break;
+            case OP_IFLE:
+              taken = val <= 0;
+              break;
+          }
 
-          CP_Info field_ref = get_cp_info(field_index);
-          CP_Info class_name = get_class_name(field_ref.class_index);
-          CP_Info member_name = get_member_name(field_ref.name_and_type_index);
+          if (taken && jump(inst->operand)) {
+            return;
+          }
+        } NEXT();
+        OPCODE(OP_IF_ICMPEQ)
+        OPCODE(OP_IF_ICMPNE)
+        OPCODE(OP_IF_ICMPLT)
+        OPCODE(OP_IF_ICMPGE)
+        OPCODE(OP_IF_ICMPGT)
+        OPCODE(OP_IF_ICMPLE) {
+          long int r = pop().int_value;
+          long int l = pop().int_value;
+          bool taken = false;
 
-          Value type = make_type(class_name.utf8, member_name.utf8);
-          push(type);
-        } break;
-        case OP_INVOKEVIRTUAL: {
-          u16 method_index = fetch_u16();
+          switch (opcode) {
+            case OP_IF_ICMPEQ:
+              taken = l == r;
+              break;
+            case OP_IF_ICMPNE:
+              taken = l != r;
+              break;
+            case OP_IF_ICMPLT:
+              taken = l < r;
+              break;
+            case OP_IF_ICMPGE:
+              taken = l >= r;
+              break;
+            case OP_IF_ICMPGT:
+              taken = l > r;
+              break;
+            case OP_IF_ICMPLE:
+              taken = l <= r;
+              break;
+          }
 
-          CP_Info method_ref = get_cp_info(method_index);
-          CP_Info class_name = get_class_name(method_ref.class_index);
-          CP_Info member_name = get_member_name(method_ref.name_and_type_index);
+          if (taken && jump(inst->operand)) {
+            return;
+          }
+        } NEXT();
+        OPCODE(OP_GOTO) {
+          if (jump(inst->operand)) {
+            return;
+          }
+        } NEXT();
+        OPCODE(OP_IRETURN)
+        OPCODE(OP_ARETURN)
+        OPCODE(OP_RETURN) {
+          return;
+        } NEXT();
+        OPCODE(QUICK_GETSTATIC) {
+          s64 value = load_static(inst->field);
+          push(inst->field->type->type == NType::ARRAY ? make_array((Array_Object *) value) : make_int(value));
+        } NEXT();
+        OPCODE(QUICK_GETSTATIC_REF) {
+          push(make_type(inst->ref->clazz, inst->ref->member));
+        } NEXT();
+        OPCODE(QUICK_PUTSTATIC) {
+          Value value = pop();
+          store_static(inst->field, value.type == Value::ARRAY ? (s64) value.array : value.int_value);
+        } NEXT();
+        OPCODE(QUICK_INVOKE) {
+          call(inst->method, inst->operand);
+        } NEXT();
+        OPCODE(QUICK_PRINTLN) {
+          Value val = pop();
+          Value field = pop();
 
-          if (class_name.utf8 == "java/io/PrintStream" && member_name.utf8 == "println") {
-            Value val = pop();
-            Value field = pop();
+          if (field.ref.clazz == "java/lang/System" && field.ref.member == "out") {
+            value_print(val);
+          }
+        } NEXT();
+        OPCODE(QUICK_NEW) {
+          push(make_object(*inst->utf8));
+        } NEXT();
+        OPCODE(QUICK_NOP) {
+        } NEXT();
+        /* the forms below resolve their constant pool reference, rewrite the
+           instruction to its quick form and run that */
+        OPCODE(OP_GETSTATIC)
+        OPCODE(OP_PUTSTATIC)
+        OPCODE(OP_INVOKEVIRTUAL)
+        OPCODE(OP_INVOKESPECIAL)
+        OPCODE(OP_INVOKESTATIC)
+        OPCODE(OP_NEW) {
+          quicken(inst);
+          pc--;
+        } NEXT();
+        OPCODE(OP_NEWARRAY) {
+          u8 type = inst->operand;
+          long int length = pop().int_value;
 
-            if (field.clazz == "java/lang/System" && field.member == "out") {
-              value_print(val);
+          push(make_array(new_array(length, type)));
+        } NEXT();
+        OPCODE(OP_ARRAYLENGTH) {
+          Array_Object *arr = pop().array;
+          push(make_int(arr->length));
+        } NEXT();
+        OPCODE_DEFAULT {
+          printf("Unhandled opcode: %02x\n", opcode);
+        } NEXT();
+#if !NJVM_COMPUTED_GOTO
+      }
+      }
+#endif
+    }
+
+    /* Translates the bytecode of m into fixed width instructions, done once before
+       its first frame runs. Operands are decoded, branch targets become indices
+       into the instruction array and the variants of loads, stores and constants
+       collapse into one form each. Instructions referencing the constant pool
+       keep the index, quicken() resolves them on first execution. */
+    Instruction *decode(Method *m) {
+      Code ci = find_code(m);
+      Method *caller = method;
+      u8 *caller_ip = ip;
+      method = m;
+
+      Instruction *insts = (Instruction *) calloc(ci.code_length, sizeof(Instruction));
+      u32 *index_of = (u32 *) malloc(ci.code_length * sizeof(u32));
+      u32 count = 0;
+
+      ip = ci.code;
+      while (ip < ci.code + ci.code_length) {
+        Instruction *inst = &insts[count];
+        inst->offset = ip - ci.code;
+        index_of[inst->offset] = count++;
+
+        u8 opcode = fetch_u8();
+        inst->opcode = opcode;
+
+        switch (opcode) {
+          case OP_ICONST_0:
+          case OP_ICONST_1:
+          case OP_ICONST_2:
+          case OP_ICONST_3:
+          case OP_ICONST_4:
+          case OP_ICONST_5:
+            inst->opcode = QUICK_ICONST;
+            inst->value = opcode - OP_ICONST_0;
+            break;
+          case OP_BIPUSH:
+            inst->opcode = QUICK_ICONST;
+            inst->value = (s8) fetch_u8();
+            break;
+          case OP_SIPUSH:
+            inst->opcode = QUICK_ICONST;
+            inst->value = (s16) fetch_u16();
+            break;
+          case OP_LDC: {
+            CP_Info *cnst = &clazz->constant_pool[fetch_u8() - 1];
+
+            switch (cnst->tag) {
+              case CONSTANT_Integer:
+              case CONSTANT_Long:
+                inst->opcode = QUICK_ICONST;
+                inst->value = (s64) cnst->long_int;
+                break;
+              case CONSTANT_String:
+                inst->opcode = QUICK_LDC_STRING;
+                inst->utf8 = &clazz->constant_pool[cnst->string_index - 1].utf8;
+                break;
+              default:
+                printf("No implementation for LDC of tag %d\n", cnst->tag);
+                inst->opcode = QUICK_NOP;
+                break;
             }
+          } break;
+          case OP_ILOAD:
+          case OP_ALOAD:
+            inst->opcode = OP_ILOAD;
+            inst->operand = fetch_u8();
+            break;
+          case OP_ILOAD_0:
+          case OP_ILOAD_1:
+          case OP_ILOAD_2:
+          case OP_ILOAD_3:
+            inst->opcode = OP_ILOAD;
+            inst->operand = opcode - OP_ILOAD_0;
+            break;
+          case OP_ALOAD_0:
+          case OP_ALOAD_1:
+          case OP_ALOAD_2:
+          case OP_ALOAD_3:
+            inst->opcode = OP_ILOAD;
+            inst->operand = opcode - OP_ALOAD_0;
+            break;
+          case OP_ISTORE:
+          case OP_ASTORE:
+            inst->opcode = OP_ISTORE;
+            inst->operand = fetch_u8();
+            break;
+          case OP_ISTORE_0:
+          case OP_ISTORE_1:
+          case OP_ISTORE_2:
+          case OP_ISTORE_3:
+            inst->opcode = OP_ISTORE;
+            inst->operand = opcode - OP_ISTORE_0;
+            break;
+          case OP_ASTORE_0:
+          case OP_ASTORE_1:
+          case OP_ASTORE_2:
+          case OP_ASTORE_3:
+            inst->opcode = OP_ISTORE;
+            inst->operand = opcode - OP_ASTORE_0;
+            break;
+          case OP_IINC:
+            inst->operand = fetch_u8();
+            inst->value = (s8) fetch_u8();
+            break;
+          case OP_IFEQ:
+          case OP_IFNE:
+          case OP_IFLT:
+          case OP_IFGE:
+          case OP_IFGT:
+          case OP_IFLE:
+          case OP_IF_ICMPEQ:
+          case OP_IF_ICMPNE:
+          case OP_IF_ICMPLT:
+          case OP_IF_ICMPGE:
+          case OP_IF_ICMPGT:
+          case OP_IF_ICMPLE:
+          case OP_GOTO:
+            /* still a bytecode offset, mapped below once all indices are known */
+            inst->operand = fetch_offset();
+            break;
+          case OP_GETSTATIC:
+          case OP_PUTSTATIC:
+          case OP_INVOKEVIRTUAL:
+          case OP_INVOKESPECIAL:
+          case OP_INVOKESTATIC:
+          case OP_NEW:
+            inst->operand = fetch_u16();
+            break;
+          case OP_NEWARRAY:
+            inst->operand = fetch_u8();
+            break;
+        }
+      }
+
+      for (u32 i = 0; i < count; ++i) {
+        Instruction *inst = &insts[i];
+        if ((inst->opcode >= OP_IFEQ && inst->opcode <= OP_IF_ICMPLE) || inst->opcode == OP_GOTO) {
+          inst->operand = index_of[inst->operand];
+        }
+      }
+      free(index_of);
+
+      m->instructions = insts;
+      method = caller;
+      ip = caller_ip;
+      return insts;
+    }
+
+    /* Resolves the constant pool reference of inst and rewrites it in place, the
+       next executions take the quick form directly */
+    void quicken(Instruction *inst) {
+      switch (inst->opcode) {
+        case OP_GETSTATIC:
+        case OP_PUTSTATIC: {
+          Field *field = resolve_field(inst->operand);
+          if (field) {
+            class_registry.initialize(field->clazz);
+            inst->opcode = inst->opcode == OP_GETSTATIC ? QUICK_GETSTATIC : QUICK_PUTSTATIC;
+            inst->field = field;
+          } else if (inst->opcode == OP_GETSTATIC) {
+            CP_Info &field_ref = get_cp_info(inst->operand);
+            inst->opcode = QUICK_GETSTATIC_REF;
+            inst->ref = new Static_Ref();
+            inst->ref->clazz = get_class_name(field_ref.class_index).utf8;
+            inst->ref->member = get_member_name(field_ref.name_and_type_index).utf8;
           } else {
-            Method *m = find_method(class_name.utf8, member_name.utf8);
-            if (m) {
-              call(m, true);
-            }
+            /* stores into fields of unknown classes are dropped */
+            inst->opcode = OP_POP;
           }
         } break;
+        case OP_INVOKEVIRTUAL:
         case OP_INVOKESPECIAL: {
-          u16 method_index = fetch_u16();
-          CP_Info method_ref = get_cp_info(method_index);
-          CP_Info class_name = get_class_name(method_ref.class_index);
-          CP_Info member_name = get_member_name(method_ref.name_and_type_index);
+          if (inst->opcode == OP_INVOKEVIRTUAL && is_member_ref(inst->operand, "java/io/PrintStream", "println")) {
+            inst->opcode = QUICK_PRINTLN;
+            break;
+          }
 
-          Method *m = find_method(class_name.utf8, member_name.utf8);
+          Method *m = resolve_method(inst->operand);
           if (m) {
-              call(m, true);
+            inst->opcode = QUICK_INVOKE;
+            inst->method = m;
+            inst->operand = true;
+          } else {
+            inst->opcode = QUICK_NOP;
           }
         } break;
         case OP_INVOKESTATIC: {
-          u16 method_index = fetch_u16();
-
-          CP_Info method_ref = get_cp_info(method_index);
-          CP_Info member_name = get_member_name(method_ref.name_and_type_index);
+          Method *m = resolve_method(inst->operand);
+          if (!m) {
+            unresolved_method(inst->operand);
+          }
+          class_registry.initialize(m->clazz);
 
-          Method *m = find_method(member_name.utf8);
-          call(m, false);
+          inst->opcode = QUICK_INVOKE;
+          inst->method = m;
+          inst->operand = false;
         } break;
         case OP_NEW: {
-          u16 index = fetch_u16();
-
-          CP_Info constant_clazz = get_cp_info(index);
-          CP_Info class_name = get_cp_info(constant_clazz.name_index);
+          Class *c = resolve_class(inst->operand);
+          if (c) {
+            class_registry.initialize(c);
+          }
 
-          push(make_object(class_name.utf8));
+          inst->opcode = QUICK_NEW;
+          inst->utf8 = &get_class_name(inst->operand).utf8;
         } break;
-        default: {
-          printf("Unhandled opcode: %02x\n", opcode);
-        };
       }
+    }
 
+    /* Branch to an instruction index of the current method. Jumping backwards is
+       a loop back edge, which counts towards compiling the method. Returns true if
+       the rest of the method ran in compiled code (see try_osr()) */
+    bool jump(u32 target) {
+      Instruction *next = method->instructions + target;
+      bool back_edge = next < pc;
+      pc = next;
+
+      if (back_edge) {
+        method->backedge_count++;
+        maybe_compile(method);
+
+        if (jit && method->backedge_count >= options->tier_threshold) {
+          return try_osr(next->offset);
+        }
+      }
       return false;
     }
 
-    void call_main(Method *m) {
-      Code ci = find_code(m);
-      method = m;
+    /* On-stack replacement: a hot loop of a frame that is still interpreted (like
+       main) is compiled with an entry at its header. Once that is ready, the frame
+       is handed over to it and the compiled code runs the method to the end. */
+    bool try_osr(u16 off) {
+      Osr_Entry *e = method->osr_entries;
+      while (e && e->offset != off) {
+        e = e->next;
+      }
+
+      if (!e) {
+        request_osr(off);
+        return false;
+      }
+
+      void *code = std::atomic_ref<void *>(e->code).load(std::memory_order_acquire);
+      if (!code) {
+        return false;
+      }
+
+      u16 length = frame_length();
+      u8 *shape = (u8 *) alloca(length);
+      if (!frame_shape(shape) || length != e->shape_length || memcmp(shape, e->shape, length)) {
+        return false;
+      }
+
+      s64 *state = (s64 *) alloca(length * sizeof(s64));
+      for (u16 i = 0; i < length; ++i) {
+        Value v = frame_slot(i);
+        state[i] = v.type == Value::ARRAY ? (s64) v.array : v.int_value;
+      }
+
+      s64 (*osr)(s64 *) = (s64 (*)(s64 *)) code;
+      s64 ret = osr(state);
 
-      stack = (Value *) malloc(ci.max_stack * sizeof(Value));
-      locals = (Value *) malloc(ci.max_locals * sizeof(Value));
-      ip = ci.code;
       sp = 0;
+      if (method->type->return_type->type != NType::VOID) {
+        push(make_result(method, ret));
+      }
+      return true;
+    }
+
+    /* Compiles an entry for the current frame shape. Frames holding values the
+       compiled code can't represent get an entry without code, so they aren't
+       looked at again. */
+    void request_osr(u16 off) {
+      Osr_Entry *e = new Osr_Entry();
+      e->offset = off;
+      e->shape_length = frame_length();
+      e->shape = (u8 *) malloc(e->shape_length);
+      e->next = method->osr_entries;
+      method->osr_entries = e;
 
-      bool ret_type = false;
-      while (!ret_type) {
-        ret_type = execute();
+      if (frame_shape(e->shape)) {
+        jit->compile_osr_async(method, e);
       }
     }
 
-    void call(Method *m, bool on_object) {
-      Code ci = find_code(m);
-      method = m;
+    u16 frame_length() {
+      return method->code.max_locals + sp;
+    }
+
+    Value frame_slot(u16 i) {
+      u16 max_locals = method->code.max_locals;
+      return i < max_locals ? locals[i] : stack[i - max_locals];
+    }
+
+    bool frame_shape(u8 *shape) {
+      for (u16 i = 0; i < frame_length(); ++i) {
+        Value v = frame_slot(i);
 
+        switch (v.type) {
+          case Value::NONE:
+            shape[i] = OSR_NONE;
+            break;
+          case Value::INT:
+            shape[i] = OSR_INT;
+            break;
+          case Value::ARRAY:
+            shape[i] = OSR_ARRAY | v.array->type;
+            break;
+          default:
+            return false;
+        }
+      }
+      return true;
+    }
+
+    void maybe_compile(Method *m) {
+      if (!jit || m->compile_requested) {
+        return;
+      }
+
+      if (m->invocation_count + m->backedge_count >= options->tier_threshold && jit::method_has_adapter(m)) {
+        m->compile_requested = true;
+        jit->compile_async(m);
+      }
+    }
+
+    void call_main(Method *m) {
       Call_Frame frame = save_frame();
+      enter(m, frame_stack.top, 0);
 
-      stack = (Value *) malloc(ci.max_stack * sizeof(Value));
-      locals = (Value *) malloc(ci.max_locals * sizeof(Value));
-      ip = ci.code;
-      sp = 0;
+      execute();
 
-      u8 par_count = m->type->parameters.length;
+      restore_frame(frame);
+    }
+
+    void call(Method *m, bool on_object) {
+      m->invocation_count++;
+      maybe_compile(m);
 
-      for (int k = 0; k < par_count; ++k) {
-        store(k, frame.stack[--frame.sp]);
+      void *native_code = std::atomic_ref<void *>(m->native_code).load(std::memory_order_acquire);
+      if (native_code) {
+        call_native(m, native_code, on_object);
+        return;
       }
 
+      u8 par_count = m->type->parameters.length;
+      Value *args = stack + sp - par_count;
+
+      Call_Frame frame = save_frame();
+      frame.sp -= par_count;
       if (on_object) {
         /* TOOD: figure out what I must do with this? */
         frame.sp--;
       }
 
-      bool ret_type = false;
-      while (!ret_type) {
-        ret_type = execute();
+      enter(m, args, par_count);
+
+      execute();
+
+      bool has_result = m->type->return_type->type != NType::VOID;
+      Value result;
+      if (has_result) {
+        result = pop();
+      }
+
+      restore_frame(frame);
+
+      if (has_result) {
+        push(result);
+      }
+    }
+
+    /* Sets up a frame for m whose first locals are the arg_count values at args */
+    void enter(Method *m, Value *args, u8 arg_count) {
+      Code ci = find_code(m);
+      method = m;
+      clazz = m->clazz;
+
+      locals = frame_stack.allocate(args, arg_count, ci.max_locals + ci.max_stack);
+      for (u32 i = arg_count; i < ci.max_locals + ci.max_stack; ++i) {
+        locals[i].type = Value::NONE;
+      }
+
+      stack = locals + ci.max_locals;
+      pc = m->instructions ? m->instructions : decode(m);
+      sp = 0;
+    }
+
+    /* Calls the compiled code of m through its adapter, see jit::method_has_adapter() */
+    void call_native(Method *m, void *native_code, bool on_object) {
+      s64 (*adapter)(s64 *) = (s64 (*)(s64 *)) native_code;
+
+      u8 par_count = m->type->parameters.length;
+      s64 *args = (s64 *) alloca((par_count + 1) * sizeof(s64));
+      for (int k = par_count - 1; k >= 0; --k) {
+        Value v = pop();
+        args[k] = v.type == Value::ARRAY ? (s64) v.array : v.int_value;
       }
 
-      // return value
+      if (on_object) {
+        pop();
+      }
+
+      s64 ret = adapter(args);
       if (m->type->return_type->type != NType::VOID) {
-        frame.stack[frame.sp++] = pop();
+        push(make_result(m, ret));
       }
+    }
 
-      restore_frame(frame);
+    /* Result of compiled code for m, ints and arrays come back as a word */
+    Value make_result(Method *m, s64 ret) {
+      return m->type->return_type->type == NType::ARRAY ? make_array((Array_Object *) ret) : make_int(ret);
+    }
+
+    s64 array_load(Array_Object *arr, s64 index) {
+      if ((u64) index >= (u64) arr->length) {
+        njvm_index_out_of_bounds(index, arr->length);
+      }
+
+      u8 *data = arr->data();
+      switch (arr->type) {
+        case TYPE_BOOLEAN:
+          return ((u8 *) data)[index];
+        case TYPE_BYTE:
+          return ((s8 *) data)[index];
+        case TYPE_SHORT:
+          return ((s16 *) data)[index];
+        case TYPE_INT:
+          return ((s32 *) data)[index];
+        default:
+          return ((s64 *) data)[index];
+      }
+    }
+
+    void array_store(Array_Object *arr, s64 index, s64 value) {
+      if ((u64) index >= (u64) arr->length) {
+        njvm_index_out_of_bounds(index, arr->length);
+      }
+
+      u8 *data = arr->data();
+      switch (arr->type) {
+        case TYPE_BOOLEAN:
+          ((u8 *) data)[index] = (u8) value;
+          break;
+        case TYPE_BYTE:
+          ((s8 *) data)[index] = (s8) value;
+          break;
+        case TYPE_SHORT:
+          ((s16 *) data)[index] = (s16) value;
+          break;
+        case TYPE_INT:
+          ((s32 *) data)[index] = (s32) value;
+          break;
+        default:
+          ((s64 *) data)[index] = value;
+          break;
+      }
     }
 
     void push(Value val) {
@@ -318,19 +1000,19 @@ namespace interp {
       frame.method = method;
       frame.stack = stack;
       frame.locals = locals;
-      frame.ip = ip;
+      frame.pc = pc;
       frame.sp = sp;
+      frame.mark = frame_stack.mark();
 
       return frame;
     }
 
     void restore_frame(Call_Frame frame) {
-      delete[] stack;
-      delete[] locals;
+      frame_stack.release(frame.mark);
 
       stack = frame.stack;
       locals = frame.locals;
-      ip = frame.ip;
+      pc = frame.pc;
       sp = frame.sp;
       method = frame.method;
       clazz = frame.clazz;
@@ -343,7 +1025,7 @@ namespace interp {
       printf("Current method: ");
       string_println(method->name);
       printf("Stack pointer: 0x%02x\n", sp);
-      printf("Inst. pointer: 0x%p\n", ip);
+      printf("Inst. pointer: 0x%p (offset %u)\n", pc, pc[-1].offset);
       printf("\nStack\n");
 
       for (u8 i = 0; i < sp; ++i) {
@@ -356,6 +1038,9 @@ namespace interp {
 
     void debug_value(Value value) {
       switch (value.type) {
+        case Value::NONE:
+          printf("none\n");
+          break;
         case Value::STRING: {
           printf("string '");
           string_print(value.utf8);
@@ -367,14 +1052,17 @@ namespace interp {
           break;
         case Value::TYPE: {
           printf("type ");
-          string_print(value.clazz);
+          string_print(value.ref.clazz);
           printf(".");
-          string_println(value.member);
+          string_println(value.ref.member);
         } break;
         case Value::OBJECT: {
           printf("object ");
           string_println(value.utf8);
-        }
+        } break;
+        case Value::ARRAY: {
+          printf("array of type %d, length %d\n", value.array->type, value.array->length);
+        } break;
       }
     }
   };
@@ -410,8 +1098,8 @@ namespace interp {
   Value make_type(String clazz, String member) {
     Value v;
     v.type = Value::TYPE;
-    v.clazz = clazz;
-    v.member = member;
+    v.ref.clazz = clazz;
+    v.ref.member = member;
     return v;
   }
 
@@ -421,4 +1109,15 @@ namespace interp {
     v.utf8 = utf8;
     return v;
   }
-}
\ No newline at end of file
+
+  Value make_array(Array_Object *array) {
+    Value v;
+    v.type = Value::ARRAY;
+    v.array = array;
+    return v;
+  }
+}
+
+#undef OPCODE
+#undef OPCODE_DEFAULT
+#undef NEXT
@@ -0,0 +1,275 @@
+enum {
+  ZIP_END_OF_CENTRAL_DIRECTORY = 0x06054b50,
+  ZIP_CENTRAL_DIRECTORY_HEADER = 0x02014b50,
+  ZIP_LOCAL_FILE_HEADER = 0x04034b50,
+
+  ZIP_STORED = 0,
+  ZIP_DEFLATED = 8,
+};
+
+struct Jar_Entry {
+  String name;
+  u16 compression;
+  u32 compressed_size;
+  u32 size;
+  u32 local_header_offset;
+};
+
+/* A jar (zip) archive. Opening it only reads the central directory into an
+   index by entry name, entries are inflated when they are asked for. Stored
+   entries are used in place, the archive stays mapped. */
+struct Jar {
+  const char *file_name;
+  Reader *r;
+  Array<Jar_Entry> entries;
+  /* entry name -> index into entries */
+  Hash_Table<s64> index;
+
+  Jar(const char *file_name) : file_name(file_name) {
+    r = new Reader(file_name);
+    read_central_directory();
+  }
+
+  ~Jar() {
+    delete r;
+  }
+
+  void fail(const char *message) {
+    printf("%s: %s\n", file_name, message);
+    exit(1);
+  }
+
+  void read_central_directory() {
+    /* the end record is last, followed only by a comment of at most 64K */
+    if (r->length < 22) {
+      fail("not a zip archive");
+    }
+
+    s64 end = -1;
+    s64 lowest = r->length > 22 + 0xffff ? r->length - 22 - 0xffff : 0;
+    for (s64 p = r->length - 22; p >= lowest; --p) {
+      r->pos = p;
+      if (r->read_u32_le() == ZIP_END_OF_CENTRAL_DIRECTORY) {
+        end = p;
+        break;
+      }
+    }
+    if (end < 0) {
+      fail("not a zip archive");
+    }
+
+    r->pos = end + 10;
+    u16 entry_count = r->read_u16_le();
+    r->read_u32_le();
+    u32 directory_offset = r->read_u32_le();
+    if (entry_count == 0xffff || directory_offset == 0xffffffff) {
+      fail("zip64 archives are not supported");
+    }
+
+    entries.reserve(entry_count);
+    index.reserve(entry_count);
+
+    r->pos = directory_offset;
+    for (u16 i = 0; i < entry_count; ++i) {
+      if (r->read_u32_le() != ZIP_CENTRAL_DIRECTORY_HEADER) {
+        fail("corrupt central directory");
+      }
+
+      Jar_Entry e;
+      r->pos += 6;
+      e.compression = r->read_u16_le();
+      r->pos += 8;
+      e.compressed_size = r->read_u32_le();
+      e.size = r->read_u32_le();
+      u16 name_length = r->read_u16_le();
+      u16 extra_length = r->read_u16_le();
+      u16 comment_length = r->read_u16_le();
+      r->pos += 8;
+      e.local_header_offset = r->read_u32_le();
+      e.name.length = name_length;
+      e.name.data = r->read_bytes(name_length);
+      r->pos += extra_length + comment_length;
+
+      index.insert(e.name, entries.length);
+      entries.add(e);
+    }
+  }
+
+  Jar_Entry *find(String name) {
+    s64 *i = index.find(name);
+    return i ? &entries[*i] : 0;
+  }
+
+  /* Uncompressed contents of e. Inflated data is allocated from arena if there
+     is one, otherwise it is never freed */
+  u8 *read(Jar_Entry *e, Arena *arena = 0) {
+    u8 *data = locate(e);
+    if (e->compression == ZIP_STORED) {
+      return data;
+    }
+    return inflate_data(e, data, arena);
+  }
+
+  /* class_name in internal form, e.g. java/lang/Object */
+  Class *load_class(String class_name, Arena *arena) {
+    String entry_name = class_name + to_string(".class");
+    Jar_Entry *e = find(entry_name);
+    free(entry_name.data);
+
+    if (!e) {
+      return 0;
+    }
+    return parse(e, arena);
+  }
+
+  /* The class and its inflated bytes live in arena */
+  Class *parse(Jar_Entry *e, Arena *arena) {
+    ClassReader cr(read(e, arena), e->size, arena);
+    return cr.read();
+  }
+
+  /* The reader position is shared, so only finding the data of e is done under
+     the lock, inflating and parsing run in parallel */
+  Class *parse_locked(Jar_Entry *e, std::mutex &lock, Arena *arena) {
+    u8 *data;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      data = locate(e);
+    }
+
+    if (e->compression == ZIP_DEFLATED) {
+      data = inflate_data(e, data, arena);
+    }
+
+    ClassReader cr(data, e->size, arena);
+    return cr.read();
+  }
+
+  /* Parses every class of the archive on thread_count threads, each thread
+     allocates from its own arena which is added to arenas */
+  Array<Class *> load_all(u32 thread_count, Array<Arena *> &arenas) {
+    Array<Jar_Entry *> class_entries;
+    for (auto &e: entries) {
+      if (e.name.length > 6 && memcmp(e.name.data + e.name.length - 6, ".class", 6) == 0) {
+        class_entries.add(&e);
+      }
+    }
+
+    Array<Class *> classes;
+    classes.resize(class_entries.length);
+
+    if (thread_count < 1) {
+      thread_count = 1;
+    }
+
+    for (u32 i = 0; i < thread_count; ++i) {
+      arenas.add(new Arena());
+    }
+    Arena **thread_arenas = arenas.end() - thread_count;
+
+    std::atomic<s64> next(0);
+    std::mutex lock;
+    auto worker = [&](Arena *arena) {
+      for (s64 i = next++; i < class_entries.length; i = next++) {
+        classes[i] = parse_locked(class_entries[i], lock, arena);
+      }
+    };
+
+    Array<std::thread *> threads;
+    for (u32 i = 1; i < thread_count; ++i) {
+      threads.add(new std::thread(worker, thread_arenas[i]));
+    }
+    worker(thread_arenas[0]);
+    for (auto t: threads) {
+      t->join();
+      delete t;
+    }
+
+    return classes;
+  }
+
+  /* Start of the (possibly compressed) data of e */
+  u8 *locate(Jar_Entry *e) {
+    r->pos = e->local_header_offset;
+    if (r->read_u32_le() != ZIP_LOCAL_FILE_HEADER) {
+      fail("corrupt local file header");
+    }
+    r->pos += 22;
+    u16 name_length = r->read_u16_le();
+    u16 extra_length = r->read_u16_le();
+    r->pos += name_length + extra_length;
+
+    if (r->length - r->pos < e->compressed_size) {
+      fail("truncated entry");
+    }
+    if (e->compression != ZIP_STORED && e->compression != ZIP_DEFLATED) {
+      fail("unsupported compression method");
+    }
+    return r->bytes + r->pos;
+  }
+
+  u8 *inflate_data(Jar_Entry *e, u8 *data, Arena *arena = 0) {
+    u64 size = e->size ? e->size : 1;
+    u8 *out = (u8 *) (arena ? arena->allocate(size) : malloc(size));
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    zs.next_in = data;
+    zs.avail_in = e->compressed_size;
+    zs.next_out = out;
+    zs.avail_out = e->size;
+
+    /* negative window bits: raw deflate data without zlib header */
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+      fail("inflate failed");
+    }
+    int status = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+
+    if (status != Z_STREAM_END || zs.total_out != e->size) {
+      fail("inflate failed");
+    }
+
+    return out;
+  }
+
+  /* Main-Class of the manifest, if there is one */
+  String main_class() {
+    String main;
+    Jar_Entry *e = find(to_string("META-INF/MANIFEST.MF"));
+    if (!e) {
+      return main;
+    }
+
+    u8 *data = read(e);
+    const char *key = "Main-Class:";
+    u32 key_length = strlen(key);
+
+    for (u32 line = 0; line < e->size;) {
+      u32 end = line;
+      while (end < e->size && data[end] != '\n' && data[end] != '\r') {
+        end++;
+      }
+
+      if (end - line > key_length && memcmp(data + line, key, key_length) == 0) {
+        u32 start = line + key_length;
+        while (start < end && data[start] == ' ') {
+          start++;
+        }
+
+        /* manifests use dots, class files slashes */
+        main.length = end - start;
+        main.data = (u8 *) malloc(main.length);
+        for (u16 i = 0; i < main.length; ++i) {
+          u8 c = data[start + i];
+          main.data[i] = c == '.' ? '/' : c;
+        }
+        return main;
+      }
+
+      line = end + 1;
+    }
+
+    return main;
+  }
+};
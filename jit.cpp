@@ -3,8 +3,18 @@ void print_int(s64 a) {
   printf("%lld\n", a);
 }
 
-void *create_array(s64 size, s64 type_size) {
-  return malloc(type_size * size);
+/* Java throws an ArrayIndexOutOfBoundsException, there are no exceptions yet
+   so the program stops. Used by both backends. Compile threads may still be
+   running, so no static destructors run. */
+void njvm_index_out_of_bounds(s64 index, s64 length) {
+  printf("ArrayIndexOutOfBoundsException: Index %lld out of bounds for length %lld\n", (long long) index, (long long) length);
+  fflush(stdout);
+  _Exit(1);
+}
+
+/* Slow path of the class initialization check in compiled code */
+void njvm_initialize_class(Class *clazz) {
+  class_registry.initialize(clazz);
 }
 }
 
@@ -14,52 +24,252 @@ namespace jit {
 
 #define STR_REF(x) StringRef((const char * ) x.data, x.length)
 
+  /* Value of an operand stack slot or local variable during translation. Ints
+     are i64 SSA values, arrays an i8* to their Array_Object. The length of an
+     array allocated in the method is known, others read it from the header. */
+  struct JavaValue {
+    enum JavaValueType {
+      NONE,
+      INT,
+      ARRAY,
+      CLASS
+    };
+
+    JavaValueType type = NONE;
+    Value *llvm_ref = 0;
+    Value *length = 0;
+    u8 array_type = 0;
+    String name;
+  };
+
+  struct FrameState {
+    JavaValue *stack = 0;
+    JavaValue *locals = 0;
+    u8 sp = 0;
+  };
+
+  /* Entry state of a block during the escape analysis: the allocation sites
+     whose arrays may be in each slot, see Translator::find_stack_arrays() */
+  struct Site_State {
+    bool reached = false;
+    u8 sp = 0;
+    u64 *stack = 0;
+    u64 *locals = 0;
+  };
+
+  struct Block {
+    u16 offset;
+    BasicBlock *block;
+    /* Set when the first edge into the block is translated. Every slot defined
+       on that edge becomes a phi node, later edges only add incoming values */
+    bool reached;
+    FrameState entry;
+  };
+
   struct ControlFlow {
-    Array<u16> offsets;
-    Array<BasicBlock *> blocks;
+    Array<Block> blocks;
 
     void add(u16 offset, BasicBlock *block) {
-      offsets.add(offset);
-      blocks.add(block);
+      Block b;
+      b.offset = offset;
+      b.block = block;
+      b.reached = false;
+      blocks.add(b);
     }
 
-    BasicBlock *find(u16 offset) {
-      for (s64 i = 0; i < offsets.length; ++i)
-        if (offsets[i] == offset)
-          return blocks[i];
+    Block *find(u16 offset) {
+      for (s64 i = 0; i < blocks.length; ++i)
+        if (blocks[i].offset == offset)
+          return &blocks[i];
 
       return 0;
     }
   };
 
-  struct JavaArray {
-    Value *llvm_ref = 0;
-    Value *length = 0;
-    u8 type = 0;
+  struct Jit;
+
+  /* Defines the body symbol of a single method. The method is only lowered to IR
+     (and handed to the compile layer) once something looks the symbol up, which
+     happens when its lazy call-through stub is called for the first time. */
+  struct MethodMaterializationUnit : MaterializationUnit {
+    Jit *jit;
+    Method *method;
+    /* set for the OSR entry of a loop header instead of the method itself */
+    Osr_Entry *osr;
+
+    MethodMaterializationUnit(Jit *jit, Method *method, SymbolFlagsMap symbols, Osr_Entry *osr = 0)
+      : MaterializationUnit(Interface(std::move(symbols), nullptr)), jit(jit), method(method), osr(osr) {
+    }
+
+    StringRef getName() const override {
+      return "njvm-method";
+    }
+
+    void materialize(std::unique_ptr<MaterializationResponsibility> r) override;
+
+    void discard(const JITDylib &, const SymbolStringPtr &) override {
+    }
   };
 
-  struct JavaObject {
-    enum JavaObjectType {
-      ARRAY,
-      CLASS
-    };
+  /* Stores the object code of compiled methods in a directory. The file of a method
+     is named after a hash of the class file bytes of its class and the classes
+     it refers to (see Jit::code_hash()), the njvm version, the target and the
+     optimization level, so it is only reused for identical inputs. */
+  struct CodeCache : ObjectCache {
+    std::string directory;
+    u64 key;
+
+    CodeCache(const char *directory, StringRef cpu, StringRef features, u8 opt_level) : directory(directory) {
+      key = hash_bytes(NJVM_VERSION, strlen(NJVM_VERSION));
+      key = hash_bytes(cpu.data(), cpu.size(), key);
+      key = hash_bytes(features.data(), features.size(), key);
+      key = hash_bytes(&opt_level, sizeof(opt_level), key);
+
+      sys::fs::create_directories(directory);
+    }
 
-    JavaObjectType type;
-    JavaArray array;
-    String name;
+    std::string path_of(StringRef name, u64 code_hash) {
+      u64 h = hash_bytes(&code_hash, sizeof(code_hash), key);
+      h = hash_bytes(name.data(), name.size(), h);
+
+      char file[32];
+      snprintf(file, sizeof(file), "%016llx.o", (unsigned long long) h);
+
+      SmallString<256> path(directory);
+      sys::path::append(path, file);
+      return std::string(path.str());
+    }
+
+    std::unique_ptr<MemoryBuffer> load(StringRef name, u64 code_hash) {
+      auto buffer = MemoryBuffer::getFile(path_of(name, code_hash));
+      if (!buffer) {
+        return nullptr;
+      }
+      return std::move(*buffer);
+    }
+
+    /* Only method modules carry a code hash, others aren't cached */
+    bool code_hash_of(const Module *m, u64 *code_hash) {
+      auto *flag = mdconst::extract_or_null<ConstantInt>(m->getModuleFlag("njvm.code_hash"));
+      if (!flag) {
+        return false;
+      }
+      *code_hash = flag->getZExtValue();
+      return true;
+    }
+
+    void notifyObjectCompiled(const Module *m, MemoryBufferRef obj) override {
+      u64 code_hash;
+      if (!code_hash_of(m, &code_hash)) {
+        return;
+      }
+
+      /* write to a temporary and rename, so concurrent runs never see half written files */
+      std::string path = path_of(m->getModuleIdentifier(), code_hash);
+      SmallString<256> temp_path;
+      int fd;
+      if (sys::fs::createUniqueFile(path + ".tmp%%%%%%", fd, temp_path)) {
+        return;
+      }
+
+      {
+        raw_fd_ostream out(fd, true);
+        out << obj.getBuffer();
+      }
+
+      if (sys::fs::rename(temp_path, path)) {
+        sys::fs::remove(temp_path);
+      }
+    }
+
+    std::unique_ptr<MemoryBuffer> getObject(const Module *m) override {
+      u64 code_hash;
+      if (!code_hash_of(m, &code_hash)) {
+        return nullptr;
+      }
+      return load(m->getModuleIdentifier(), code_hash);
+    }
   };
 
-  struct Jit : Backend {
-    LLVMContext context;
+  void lazy_compile_failed() {
+    printf("Lazy compilation of method failed\n");
+    exit(1);
+  }
+
+  /* overloads only differ in their descriptor */
+  String method_name(Method *m) {
+    return m->clazz->name + to_string(".") + m->name + m->descriptor;
+  }
+
+  String method_body_name(Method *m) {
+    return method_name(m) + to_string("$body");
+  }
+
+  String method_adapter_name(Method *m) {
+    return method_name(m) + to_string("$i2c");
+  }
+
+  String method_osr_name(Method *m, u16 offset) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "$osr%u", offset);
+    return method_name(m) + to_string(suffix);
+  }
+
+  /* Parameters of other types aren't passed to compiled code */
+  bool is_passed(NType *type) {
+    return type->type == NType::INT || type->type == NType::ARRAY;
+  }
+
+  /* The interpreter can only call into compiled code with int and array
+     arguments and results, those methods get an adapter taking the arguments
+     as an array of words */
+  bool method_has_adapter(Method *m) {
+    for (auto pty: m->type->parameters) {
+      if (!is_passed(pty)) {
+        return false;
+      }
+    }
+
+    switch (m->type->return_type->type) {
+      case NType::VOID:
+      case NType::BOOL:
+      case NType::BYTE:
+      case NType::SHORT:
+      case NType::INT:
+      case NType::LONG:
+      case NType::ARRAY:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  /* Translation state of a single module. Every compilation owns its context,
+     so independent methods can be translated on different compile threads */
+  struct Translator : Backend {
+    ThreadSafeContext tsc;
+    LLVMContext &context;
     std::unique_ptr<Module> module;
+    Function *function;
     IRBuilder<> *irb;
-    Value **stack_int;
-    Value **locals_int;
-
-    JavaObject *stack_object;
-    JavaObject *locals_object;
+    /* abstract interpreter state of the block being translated */
+    JavaValue *stack;
+    JavaValue *locals;
+    u16 max_locals;
+    /* shadow stack slots of the frame slots (locals, then the operand stack),
+       see get_root() */
+    AllocaInst **roots = 0;
+    /* bit of each NEWARRAY (by offset) the escape analysis reached, and the
+       sites whose arrays don't escape */
+    DenseMap<u16, u8> array_sites;
+    u64 stack_sites = 0;
+
+    /* arrays up to this size (header included) may be allocated in the frame */
+    static const u64 STACK_ARRAY_MAX = 1024;
 
     ControlFlow control_flow;
+    Array<Block *> worklist;
+    DenseMap<NType *, Type *> converted_types;
 
     Type *llty_i1;
     Type *llty_i8;
@@ -69,20 +279,11 @@ namespace jit {
     Type *llty_void;
     Type *llty_i8_ptr;
 
-    // TODO: move somewhere else later
-    Function *print_int_fn = 0;
-    Function *create_array_fn = 0;
-
-    Array<Function *> static_init_functions;
-
-    Jit(Class *main_clazz) : Backend(main_clazz) {
-      InitializeAllTargetInfos();
-      InitializeAllTargets();
-      InitializeAllTargetMCs();
-      InitializeAllAsmParsers();
-      InitializeAllAsmPrinters();
-
-      module = std::make_unique<Module>("njit", context);
+    Translator(Class *clazz, String module_name, const DataLayout &layout, Method *m = 0)
+      : Backend(clazz), tsc(std::make_unique<LLVMContext>()), context(*tsc.getContext()) {
+      method = m;
+      module = std::make_unique<Module>(STR_REF(module_name), context);
+      module->setDataLayout(layout);
       irb = new IRBuilder<>(context);
 
       llty_i1 = Type::getInt1Ty(context);
@@ -92,92 +293,87 @@ namespace jit {
       llty_i64 = Type::getInt64Ty(context);
       llty_void = Type::getVoidTy(context);
       llty_i8_ptr = llty_i8->getPointerTo();
-
-      // TODO: move somewhere else later
-      auto print_int_fn_ty = FunctionType::get(llty_void, {llty_i64}, false);
-      print_int_fn = Function::Create(print_int_fn_ty, Function::ExternalLinkage, "print_int", *module);
-
-      auto create_array_fn_ty = FunctionType::get(llty_i8_ptr, {llty_i64, llty_i64}, false);
-      create_array_fn = Function::Create(create_array_fn_ty, Function::ExternalLinkage, "create_array", *module);
-
-      convert_class(main_clazz);
     }
 
-    void convert_class(Class *clazz) {
-      this->clazz = clazz;
-      for (u16 i = 0; i < clazz->fields_count; ++i) {
-        convert_field(&clazz->fields[i]);
-      }
-
-      for (u16 i = 0; i < clazz->methods_count; ++i) {
-        convert_method(&clazz->methods[i]);
-      }
-
-      Method *static_init = find_method(clazz->name, to_string("<clinit>"));
-      if (static_init) {
-        static_init_functions.add(static_init->llvm_ref);
-      }
+    ~Translator() {
+      delete irb;
     }
 
     void run() override {
-      /* Create main function and call static init functions */
-      auto main_ty = FunctionType::get(llty_i32, {}, false);
-      auto main_fn = Function::Create(main_ty, Function::ExternalLinkage, "main", *module);
-      BasicBlock *main_entry = BasicBlock::Create(context, "", main_fn);
-      irb->SetInsertPoint(main_entry);
+      convert_method(method);
+    }
 
-      for (auto static_init_fn: static_init_functions) {
-        irb->CreateCall(static_init_fn);
-      }
+    ThreadSafeModule finish() {
+      return ThreadSafeModule(std::move(module), tsc);
+    }
 
-      /* change later to search all classes */
-      Method *main_method = find_method("main");
-      if (main_method) {
-        irb->CreateCall(main_method->llvm_ref);
+    /* Declaration of the (stub) function of m inside of the current module.
+       Nothing unwinds through compiled code, without nounwind the shadow stack
+       lowering would give every call a cleanup that pops the frame. */
+    Function *get_function(Method *m) {
+      String name = method_name(m);
+      Function *fn = module->getFunction(STR_REF(name));
+      if (!fn) {
+        fn = Function::Create(convert_function_type(m), Function::ExternalLinkage, STR_REF(name), *module);
+        fn->setDoesNotThrow();
       }
+      return fn;
+    }
 
-      irb->CreateRet(ConstantInt::get(llty_i32, 0));
+    GlobalVariable *get_global(Field *f) {
+      String name = f->clazz->name + to_string(".") + f->name;
+      module->getOrInsertGlobal(STR_REF(name), convert_type(f->type));
+      return module->getGlobalVariable(STR_REF(name));
+    }
 
-      finalize();
+    /* The Class c as an i8 global, and its init_state, see Jit::add_class() */
+    GlobalVariable *get_class_global(Class *c, const char *suffix) {
+      String name = c->name + to_string(suffix);
+      module->getOrInsertGlobal(STR_REF(name), llty_i8);
+      return module->getGlobalVariable(STR_REF(name));
     }
 
-    void finalize() {
-      // optimize();
-      module->print(outs(), 0);
-      if (verifyModule(*module, &outs())) {
+    /* Runs the static initializer of c on its first active use. Code of a class
+       only runs once its initialization started, so that's only checked for
+       other classes. The check is a load and a branch, the call is only taken
+       the first time. */
+    void initialize_class(Class *c) {
+      if (c == method->clazz) {
         return;
       }
 
-      EngineBuilder eb = EngineBuilder(std::move(module));
+      Value *state = irb->CreateLoad(llty_i8, get_class_global(c, ".$init_state"));
+      Value *initialized = irb->CreateICmpEQ(state, ConstantInt::get(llty_i8, Class::INITIALIZED));
 
-      ExecutionEngine *ee = eb.create();
+      BasicBlock *fast = irb->GetInsertBlock();
+      BasicBlock *slow = BasicBlock::Create(context, "", function);
+      BasicBlock *done = BasicBlock::Create(context, "", function);
+      irb->CreateCondBr(initialized, done, slow);
 
-      void (*print_int_ptr)(s64) = print_int;
-      ee->addGlobalMapping(print_int_fn, (void *) print_int_ptr);
+      /* the initializer may allocate */
+      FrameState before = copy_state();
+      irb->SetInsertPoint(slow);
+      spill_roots();
+      irb->CreateCall(get_runtime_function("njvm_initialize_class", llty_void, {llty_i8_ptr}), {get_class_global(c, ".$class")});
+      reload_roots();
+      irb->CreateBr(done);
 
-      void *(*create_array_ptr)(s64, s64) = create_array;
-      ee->addGlobalMapping(create_array_fn, (void *) create_array);
-
-      s32 (*main)() = (s32 (*)()) (intptr_t) ee->getFunctionAddress("main");
-      main();
+      irb->SetInsertPoint(done);
+      merge_roots(before, fast, slow);
     }
 
-    void SetInsertBlock(BasicBlock *bb) {
-      if (!irb->GetInsertBlock()->getTerminator()) {
-        irb->CreateBr(bb);
+    Function *get_runtime_function(const char *name, Type *ret, ArrayRef<Type *> params) {
+      Function *fn = module->getFunction(name);
+      if (!fn) {
+        fn = Function::Create(FunctionType::get(ret, params, false), Function::ExternalLinkage, name, *module);
+        fn->setDoesNotThrow();
       }
-
-      irb->SetInsertPoint(bb);
+      return fn;
     }
 
     void convert_opcode() {
       u8 opcode = fetch_u8();
 
-      BasicBlock *bb = control_flow.find(base_offset());
-      if (bb) {
-        SetInsertBlock(bb);
-      }
-
       switch (opcode) {
         case OP_ICONST_0:
         case OP_ICONST_1:
@@ -198,7 +394,7 @@ namespace jit {
           break;
         case OP_LDC: {
           u8 index = fetch_u8();
-          CP_Info info = get_cp_info(index);
+          CP_Info &info = get_cp_info(index);
           switch (info.tag) {
             case CONSTANT_Integer:
             case CONSTANT_Long:
@@ -210,18 +406,18 @@ namespace jit {
         }
           break;
         case OP_ILOAD: {
-          load_int(fetch_u8());
+          load(fetch_u8());
         }
           break;
         case OP_ALOAD: {
-          load_object(fetch_u8());
+          load(fetch_u8());
         }
           break;
         case OP_ALOAD_0:
         case OP_ALOAD_1:
         case OP_ALOAD_2:
         case OP_ALOAD_3: {
-          load_object(opcode - 0x2a);
+          load(opcode - 0x2a);
         }
           break;
         case OP_IALOAD:
@@ -229,42 +425,39 @@ namespace jit {
         case OP_BALOAD:
         case OP_SALOAD: {
           Value *index = pop_int();
-          JavaArray *arr = pop_array();
-
-          Value *arr_ref = load(arr->llvm_ref);
-          arr_ref = irb->CreateBitOrPointerCast(arr_ref, java_to_llvm_type(arr->type)->getPointerTo());
-          Value *pos = gep(arr_ref, index);
+          JavaValue arr = pop();
 
-          push_int(load(pos));
+          check_bounds(arr, index);
+          push_int(load(array_element(arr, index)));
         }
           break;
         case OP_ASTORE: {
-          store_object(fetch_u8());
+          store(fetch_u8());
         }
           break;
         case OP_ASTORE_0:
         case OP_ASTORE_1:
         case OP_ASTORE_2:
         case OP_ASTORE_3: {
-          store_object(opcode - 0x4b);
+          store(opcode - 0x4b);
         }
           break;
         case OP_ILOAD_0:
         case OP_ILOAD_1:
         case OP_ILOAD_2:
         case OP_ILOAD_3: {
-          load_int(opcode - 0x1a);
+          load(opcode - 0x1a);
         }
           break;
         case OP_ISTORE: {
-          store_int(fetch_u8());
+          store(fetch_u8());
         }
           break;
         case OP_ISTORE_0:
         case OP_ISTORE_1:
         case OP_ISTORE_2:
         case OP_ISTORE_3: {
-          store_int(opcode - 0x3b);
+          store(opcode - 0x3b);
         }
           break;
         case OP_IASTORE:
@@ -273,12 +466,10 @@ namespace jit {
         case OP_SASTORE: {
           Value *val = pop_int();
           Value *index = pop_int();
-          JavaArray *arr = pop_array();
+          JavaValue arr = pop();
 
-          Value *arr_ref = load(arr->llvm_ref);
-          arr_ref = irb->CreateBitOrPointerCast(arr_ref, java_to_llvm_type(arr->type)->getPointerTo());
-          Value *pos = gep(arr_ref, index);
-          llvm_store_int(val, pos);
+          check_bounds(arr, index);
+          llvm_store_int(val, array_element(arr, index));
         }
           break;
         case OP_POP: {
@@ -286,22 +477,7 @@ namespace jit {
         }
           break;
         case OP_DUP: {
-          Value *val = stack_int[sp - 1];
-          llvm_store_int(load(val), stack_int[sp]);
-
-          JavaObject *obj = &stack_object[sp - 1];
-          JavaObject *odup = &stack_object[sp];
-
-          JavaArray *arr = &obj->array;
-          JavaArray *adup = &odup->array;
-
-          odup->type = obj->type;
-          odup->name = obj->name;
-          adup->length = arr->length;
-          adup->type = arr->type;
-          irb->CreateStore(load(arr->llvm_ref), adup->llvm_ref);
-
-          sp++;
+          push(stack[sp - 1]);
         }
           break;
         case OP_IADD:
@@ -313,8 +489,8 @@ namespace jit {
         case OP_ISHR:
         case OP_IAND:
         case OP_IOR: {
-          Value *l = pop_int();
           Value *r = pop_int();
+          Value *l = pop_int();
           Instruction::BinaryOps op;
 
           switch (opcode) {
@@ -334,7 +510,7 @@ namespace jit {
               op = Instruction::BinaryOps::SRem;
               break;
             case OP_ISHL:
-              op = Instruction::BinaryOps::AShr;
+              op = Instruction::BinaryOps::Shl;
               break;
             case OP_ISHR:
               op = Instruction::BinaryOps::AShr;
@@ -360,9 +536,7 @@ namespace jit {
           u8 index = fetch_u8();
           s8 value = (s8) fetch_u8();
 
-          Value *local = load_local_int(index);
-          Value *added = irb->CreateAdd(local, make_int(value));
-          store_int(index, added);
+          locals[index].llvm_ref = irb->CreateAdd(locals[index].llvm_ref, make_int(value));
         }
           break;
         case OP_IFEQ:
@@ -439,57 +613,62 @@ namespace jit {
         case OP_GOTO: {
           u16 off = fetch_offset();
 
-          BasicBlock *target = get_or_create_block(off);
-          irb->CreateBr(target);
+          branch_to(control_flow.find(off));
         }
           break;
         case OP_RETURN:
-          irb->CreateRetVoid();
+          if (function->getReturnType()->isVoidTy()) {
+            irb->CreateRetVoid();
+          } else {
+            /* OSR entries always return an i64 */
+            irb->CreateRet(make_int(0));
+          }
           break;
         case OP_IRETURN:
-          irb->CreateRet(pop_int());
+          irb->CreateRet(irb->CreateIntCast(pop_int(), function->getReturnType(), true));
+          break;
+        case OP_ARETURN:
+          irb->CreateRet(irb->CreateBitOrPointerCast(pop().llvm_ref, function->getReturnType()));
           break;
         case OP_GETSTATIC: {
           u16 field_index = fetch_u16();
 
-          CP_Info field_ref = get_cp_info(field_index);
-          CP_Info class_name = get_class_name(field_ref.class_index);
-          CP_Info member_name = get_member_name(field_ref.name_and_type_index);
-
-          Field *field = find_field(class_name.utf8, member_name.utf8);
+          Field *field = resolve_field(field_index);
           if (field) {
-            push_int(load(field->llvm_ref));
+            initialize_class(field->clazz);
+            Value *val = load(get_global(field));
+            if (field->type->type == NType::ARRAY) {
+              push_array(val, array_type_of(field->type->element_type));
+            } else {
+              push_int(val);
+            }
           } else {
             /* TODO:  */
-            sp++;
+            push(JavaValue());
           }
         }
           break;
         case OP_PUTSTATIC: {
           u16 field_index = fetch_u16();
 
-          CP_Info field_ref = get_cp_info(field_index);
-          CP_Info class_name = get_class_name(field_ref.class_index);
-          CP_Info member_name = get_member_name(field_ref.name_and_type_index);
-
-          Field *field = find_field(class_name.utf8, member_name.utf8);
+          Field *field = resolve_field(field_index);
           if (field) {
-            Value *val = pop_int();
-            llvm_store_int(val, field->llvm_ref);
+            initialize_class(field->clazz);
+            if (field->type->type == NType::ARRAY) {
+              irb->CreateStore(pop().llvm_ref, get_global(field));
+            } else {
+              llvm_store_int(pop_int(), get_global(field));
+            }
           }
         }
           break;
         case OP_INVOKEVIRTUAL: {
           u16 method_index = fetch_u16();
 
-          CP_Info method_ref = get_cp_info(method_index);
-          CP_Info class_name = get_class_name(method_ref.class_index);
-          CP_Info member_name = get_member_name(method_ref.name_and_type_index);
-
-          if (class_name.utf8 == "java/io/PrintStream" && member_name.utf8 == "println") {
-            call(print_int_fn, 1, true);
+          if (is_member_ref(method_index, "java/io/PrintStream", "println")) {
+            call(get_runtime_function("print_int", llty_void, {llty_i64}), 1, true);
           } else {
-            Method *m = find_method(class_name.utf8, member_name.utf8);
+            Method *m = resolve_method(method_index);
             if (m) {
               call(m, true);
             }
@@ -498,11 +677,8 @@ namespace jit {
           break;
         case OP_INVOKESPECIAL: {
           u16 method_index = fetch_u16();
-          CP_Info method_ref = get_cp_info(method_index);
-          CP_Info class_name = get_class_name(method_ref.class_index);
-          CP_Info member_name = get_member_name(method_ref.name_and_type_index);
 
-          Method *m = find_method(class_name.utf8, member_name.utf8);
+          Method *m = resolve_method(method_index);
           if (m) {
             call(m, true);
           }
@@ -511,77 +687,81 @@ namespace jit {
         case OP_INVOKESTATIC: {
           u16 method_index = fetch_u16();
 
-          CP_Info method_ref = get_cp_info(method_index);
-          CP_Info member_name = get_member_name(method_ref.name_and_type_index);
-
-          Method *m = find_method(member_name.utf8);
-          if (m) {
-            call(m, false);
+          Method *m = resolve_method(method_index);
+          if (!m) {
+            unresolved_method(method_index);
           }
+          initialize_class(m->clazz);
+          call(m, false);
         }
           break;
         case OP_NEW: {
           u16 index = fetch_u16();
 
-          CP_Info constant_clazz = get_cp_info(index);
-          CP_Info class_name = get_cp_info(constant_clazz.name_index);
+          Class *c = resolve_class(index);
+          if (c) {
+            initialize_class(c);
+          }
 
-          push_class(class_name.utf8);
+          JavaValue obj;
+          obj.type = JavaValue::CLASS;
+          obj.name = get_class_name(index).utf8;
+          push(obj);
         }
           break;
         case OP_NEWARRAY: {
+          u16 offset = base_offset();
           u8 type = fetch_u8();
-          Value *size = pop_int();
-          Value *type_size = 0;
-          switch (type) {
-            case TYPE_BOOLEAN:
-              type_size = make_int(1);
-              break;
-            case TYPE_BYTE:
-              type_size = make_int(1);
-              break;
-            case TYPE_SHORT:
-              type_size = make_int(2);
-              break;
-            case TYPE_INT:
-              type_size = make_int(4);
-              break;
-            case TYPE_LONG:
-              type_size = make_int(8);
-              break;
-            default:
-              assert(0 && "Array type not implemented");
-              break;
-          }
+          Value *length = pop_int();
 
-          Value *ptr = irb->CreateCall(create_array_fn, {size, type_size});
-          push_array(ptr, type, size);
+          Value *array = is_stack_array(offset, length, type) ? allocate_stack_array(length, type) : allocate_array(length, type);
+          push_array(array, type, length);
         }
           break;
         case OP_ARRAYLENGTH: {
-          JavaArray *arr = pop_array();
-          push_int(arr->length);
+          JavaValue arr = pop();
+          push_int(array_length(arr));
         }
           break;
       }
     }
 
     void call(Method *m, bool on_object) {
-      if (!m->llvm_ref) {
-        convert_method(m);
+      Function *f = get_function(m);
+      NType *fty = m->type;
+
+      Array<Value *> args;
+      args.resize(f->arg_size());
+      s64 arg = f->arg_size();
+      for (s64 i = fty->parameters.length - 1; i >= 0; --i) {
+        JavaValue v = pop();
+        if (!is_passed(fty->parameters[i])) {
+          continue;
+        }
+
+        Type *ty = f->getArg(--arg)->getType();
+        args[arg] = v.type == JavaValue::ARRAY ? v.llvm_ref : irb->CreateIntCast(v.llvm_ref, ty, true);
       }
 
-      Value *ret_val = call(m->llvm_ref, m->type->parameters.length, on_object);
+      if (on_object) {
+        sp--;
+      }
 
-      if (m->type->return_type->type == NType::INT) {
+      spill_roots();
+      Value *ret_val = irb->CreateCall(f, ArrayRef(args.data, args.length));
+      reload_roots();
+      if (fty->return_type->type == NType::INT) {
         push_int(ret_val);
+      } else if (fty->return_type->type == NType::ARRAY) {
+        push_array(ret_val, array_type_of(fty->return_type->element_type));
       }
     }
 
     Value *call(Function *f, s64 arg_count, bool on_object) {
       Array<Value *> args;
-      for (u16 i = 0; i < arg_count; ++i) {
-        args.add(pop_int());
+      args.resize(arg_count);
+      for (s64 i = arg_count - 1; i >= 0; --i) {
+        args[i] = irb->CreateIntCast(pop_int(), f->getArg(i)->getType(), true);
       }
 
       if (on_object) {
@@ -591,45 +771,143 @@ namespace jit {
       return irb->CreateCall(f, ArrayRef(args.data, args.length));;
     }
 
-    void convert_field(Field *f) {
-      Type *ty = convert_type(f->type);
+    /* i64 adapter(i64 *args) that calls the compiled method with the arguments
+       the interpreter passes, see method_has_adapter() */
+    void convert_adapter(Method *m) {
+      String name = method_adapter_name(m);
+      auto fty = FunctionType::get(llty_i64, {llty_i64->getPointerTo()}, false);
+      auto fn = Function::Create(fty, Function::ExternalLinkage, STR_REF(name), *module);
+      fn->setDoesNotThrow();
+
+      BasicBlock *bb = BasicBlock::Create(context, "", fn);
+      irb->SetInsertPoint(bb);
 
-      String name = clazz->name + to_string(".") + f->name;
-      auto var_name = STR_REF(name);
-      module->getOrInsertGlobal(var_name, ty);
-      auto var = module->getGlobalVariable(var_name);
-      var->setInitializer(ConstantInt::get(ty, 0));
+      Array<Value *> args;
+      for (u16 i = 0; i < function->arg_size(); ++i) {
+        Value *arg = load(gep(fn->getArg(0), {make_int(i)}));
+        Type *ty = function->getArg(i)->getType();
+        args.add(ty->isPointerTy() ? irb->CreateIntToPtr(arg, ty) : irb->CreateIntCast(arg, ty, true));
+      }
 
-      f->llvm_ref = var;
+      Value *ret = irb->CreateCall(function, ArrayRef(args.data, args.length));
+      if (ret->getType()->isVoidTy()) {
+        irb->CreateRet(make_int(0));
+      } else if (ret->getType()->isPointerTy()) {
+        irb->CreateRet(irb->CreatePtrToInt(ret, llty_i64));
+      } else {
+        irb->CreateRet(irb->CreateIntCast(ret, llty_i64, true));
+      }
     }
 
+    /* Translates the method by abstract interpretation of the operand stack, the
+       stack and locals only ever hold SSA values. Blocks are translated once their
+       entry state is known, i.e. after the first edge into them was emitted. */
     void convert_method(Method *m) {
       Function *fn = convert_function_header(m);
-      m->llvm_ref = fn;
       Code ci = find_code(m);
       method = m;
 
       function_setup(ci);
 
-      u16 i = 0;
-      for (auto &arg: fn->args()) {
-        if (m->type->parameters[i]->type == NType::INT) {
-          store_int(i, &arg);
+      Argument *arg = fn->arg_begin();
+      for (u16 i = 0; i < m->type->parameters.length; ++i) {
+        NType *pty = m->type->parameters[i];
+        if (pty->type == NType::INT) {
+          JavaValue v;
+          v.type = JavaValue::INT;
+          v.llvm_ref = irb->CreateSExt(arg++, llty_i64);
+          locals[i] = v;
+        } else if (pty->type == NType::ARRAY) {
+          JavaValue v;
+          v.type = JavaValue::ARRAY;
+          v.llvm_ref = arg++;
+          v.array_type = array_type_of(pty->element_type);
+          locals[i] = v;
+        }
+      }
+
+      find_blocks(ci);
+      find_stack_arrays(ci, 0);
+      branch_to(control_flow.find(0));
+      convert_blocks(ci);
+    }
+
+    /* i64 osr(i64 *state) running m from the loop header of e on. The frame of
+       the interpreter becomes the first edge into the header, so the phis there
+       get the slot kinds of e->shape; code before the loop is never reached. */
+    void convert_osr(Method *m, Osr_Entry *e) {
+      String name = method_osr_name(m, e->offset);
+      auto fty = FunctionType::get(llty_i64, {llty_i64->getPointerTo()}, false);
+      function = Function::Create(fty, Function::ExternalLinkage, STR_REF(name), *module);
+      function->setDoesNotThrow();
+
+      BasicBlock *bb = BasicBlock::Create(context, "", function);
+      irb->SetInsertPoint(bb);
+
+      Code ci = find_code(m);
+      method = m;
+      function_setup(ci);
+
+      Value *state = function->getArg(0);
+      for (u16 i = 0; i < e->shape_length; ++i) {
+        u8 kind = e->shape[i];
+        JavaValue v;
+
+        if (kind == OSR_INT) {
+          v.type = JavaValue::INT;
+          v.llvm_ref = load(gep(state, {make_int(i)}));
+        } else if (kind & OSR_ARRAY) {
+          v.type = JavaValue::ARRAY;
+          v.llvm_ref = irb->CreateIntToPtr(load(gep(state, {make_int(i)})), llty_i8_ptr);
+          v.array_type = kind & ~OSR_ARRAY;
+        }
+
+        if (i < max_locals) {
+          locals[i] = v;
+        } else {
+          push(v);
         }
-        ++i;
       }
 
-      control_flow.offsets.clear();
+      find_blocks(ci);
+      find_stack_arrays(ci, e->offset);
+      branch_to(control_flow.find(e->offset));
+      convert_blocks(ci);
+    }
+
+    void convert_blocks(Code ci) {
+      while (worklist.length) {
+        convert_block(worklist.pop(), ci);
+      }
+
+      for (auto &b: control_flow.blocks) {
+        if (b.reached) {
+          free(b.entry.stack);
+          free(b.entry.locals);
+        } else {
+          /* dead code */
+          b.block->eraseFromParent();
+        }
+      }
+
+      remove_trivial_phis();
+
+      free(stack);
+      free(locals);
+      free(roots);
+    }
+
+    /* Every branch target and every instruction following a branch or return
+       starts a new block */
+    void find_blocks(Code ci) {
       control_flow.blocks.clear();
 
+      get_or_create_block(0);
+
       ip = ci.code;
       while (ip < ci.code + ci.code_length) {
         u8 opcode = fetch_u8();
 
-        u8 inst_type = inst_types[opcode];
-        if (inst_type == INST_LABEL || inst_type == INST_LABELW) {
-          get_or_create_block(base_offset());
-        }
         switch (opcode) {
           case OP_BIPUSH:
           case OP_ILOAD:
@@ -658,6 +936,7 @@ namespace jit {
           }
             break;
           case OP_GETSTATIC:
+          case OP_PUTSTATIC:
           case OP_INVOKEVIRTUAL:
           case OP_INVOKESPECIAL:
           case OP_INVOKESTATIC:
@@ -667,28 +946,404 @@ namespace jit {
             ip += 2;
             break;
         }
+
+        u8 inst_type = inst_types[opcode];
+        bool ends_block = inst_type == INST_LABEL || inst_type == INST_LABELW
+                          || opcode == OP_RETURN || opcode == OP_IRETURN || opcode == OP_ARETURN;
+        if (ends_block && ip < ci.code + ci.code_length) {
+          get_or_create_block(ip - ci.code);
+        }
       }
+    }
 
-      ip = ci.code;
+    /* Escape analysis of the code reachable from start, with the current
+       operand stack: finds the NEWARRAY whose arrays never leave the frame.
+       The bytecode is interpreted like for the translation, but slots only
+       hold the set of allocation sites (one bit per NEWARRAY, up to 64) whose
+       arrays may be in them, until the states at the block entries are stable.
+       Arrays escape when they are passed to a call, stored to a static field
+       or returned. A site that runs again while its last array may still be
+       in use needs a new array each time, so it doesn't qualify either. */
+    void find_stack_arrays(Code ci, u16 start) {
+      array_sites.clear();
+      stack_sites = 0;
+
+      Site_State *entries = new Site_State[control_flow.blocks.length];
+      u64 *site_stack = (u64 *) calloc(ci.max_stack + 1, sizeof(u64));
+      u64 *site_locals = (u64 *) calloc(ci.max_locals + 1, sizeof(u64));
+      u8 depth = sp;
+      u64 escaping = 0;
+      Array<Block *> work;
+
+      merge_sites(control_flow.find(start), entries, site_stack, depth, site_locals, &work);
+      while (work.length) {
+        Block *b = work.pop();
+        Site_State *entry = &entries[b - control_flow.blocks.data];
+        depth = entry->sp;
+        memcpy(site_stack, entry->stack, depth * sizeof(u64));
+        memcpy(site_locals, entry->locals, max_locals * sizeof(u64));
+
+        ip = ci.code + b->offset;
+        bool terminated = false;
+        while (!terminated) {
+          u8 opcode = fetch_u8();
+
+          switch (opcode) {
+            case OP_ICONST_0:
+            case OP_ICONST_1:
+            case OP_ICONST_2:
+            case OP_ICONST_3:
+            case OP_ICONST_4:
+            case OP_ICONST_5:
+              site_stack[depth++] = 0;
+              break;
+            case OP_BIPUSH:
+            case OP_LDC:
+              ip++;
+              site_stack[depth++] = 0;
+              break;
+            /* static fields and objects are never in the frame */
+            case OP_SIPUSH:
+            case OP_GETSTATIC:
+            case OP_NEW:
+              ip += 2;
+              site_stack[depth++] = 0;
+              break;
+            case OP_ILOAD:
+            case OP_ALOAD:
+              site_stack[depth++] = site_locals[fetch_u8()];
+              break;
+            case OP_ILOAD_0:
+            case OP_ILOAD_1:
+            case OP_ILOAD_2:
+            case OP_ILOAD_3:
+              site_stack[depth++] = site_locals[opcode - OP_ILOAD_0];
+              break;
+            case OP_ALOAD_0:
+            case OP_ALOAD_1:
+            case OP_ALOAD_2:
+            case OP_ALOAD_3:
+              site_stack[depth++] = site_locals[opcode - OP_ALOAD_0];
+              break;
+            case OP_ISTORE:
+            case OP_ASTORE:
+              site_locals[fetch_u8()] = site_stack[--depth];
+              break;
+            case OP_ISTORE_0:
+            case OP_ISTORE_1:
+            case OP_ISTORE_2:
+            case OP_ISTORE_3:
+              site_locals[opcode - OP_ISTORE_0] = site_stack[--depth];
+              break;
+            case OP_ASTORE_0:
+            case OP_ASTORE_1:
+            case OP_ASTORE_2:
+            case OP_ASTORE_3:
+              site_locals[opcode - OP_ASTORE_0] = site_stack[--depth];
+              break;
+            case OP_IALOAD:
+            case OP_LALOAD:
+            case OP_BALOAD:
+            case OP_SALOAD:
+            case OP_IADD:
+            case OP_ISUB:
+            case OP_IMUL:
+            case OP_IDIV:
+            case OP_IREM:
+            case OP_ISHL:
+            case OP_ISHR:
+            case OP_IAND:
+            case OP_IOR:
+              depth--;
+              site_stack[depth - 1] = 0;
+              break;
+            case OP_IASTORE:
+            case OP_LASTORE:
+            case OP_BASTORE:
+            case OP_SASTORE:
+              depth -= 3;
+              break;
+            case OP_POP:
+              depth--;
+              break;
+            case OP_DUP:
+              site_stack[depth] = site_stack[depth - 1];
+              depth++;
+              break;
+            case OP_INEG:
+            case OP_ARRAYLENGTH:
+              site_stack[depth - 1] = 0;
+              break;
+            case OP_IINC:
+              ip += 2;
+              break;
+            case OP_NEWARRAY: {
+              u16 offset = base_offset();
+              ip++;
+              depth--;
+
+              auto it = array_sites.find(offset);
+              if (it == array_sites.end() && array_sites.size() < 64) {
+                it = array_sites.insert({offset, (u8) array_sites.size()}).first;
+              }
+              u64 site = it != array_sites.end() ? 1ull << it->second : 0;
+
+              /* the array of the last run may only be in the local the new
+                 one is stored to right away */
+              s32 target = *ip == OP_ASTORE ? ip[1] : *ip >= OP_ASTORE_0 && *ip <= OP_ASTORE_3 ? *ip - OP_ASTORE_0 : -1;
+              for (u8 i = 0; i < depth; ++i) {
+                escaping |= site_stack[i] & site;
+              }
+              for (u16 i = 0; i < max_locals; ++i) {
+                if (i != target) {
+                  escaping |= site_locals[i] & site;
+                }
+              }
+
+              site_stack[depth++] = site;
+            }
+              break;
+            case OP_IFEQ:
+            case OP_IFNE:
+            case OP_IFLT:
+            case OP_IFGE:
+            case OP_IFGT:
+            case OP_IFLE:
+              depth--;
+              merge_sites(control_flow.find(fetch_offset()), entries, site_stack, depth, site_locals, &work);
+              break;
+            case OP_IF_ICMPEQ:
+            case OP_IF_ICMPNE:
+            case OP_IF_ICMPLT:
+            case OP_IF_ICMPGE:
+            case OP_IF_ICMPGT:
+            case OP_IF_ICMPLE:
+              depth -= 2;
+              merge_sites(control_flow.find(fetch_offset()), entries, site_stack, depth, site_locals, &work);
+              break;
+            case OP_GOTO:
+              merge_sites(control_flow.find(fetch_offset()), entries, site_stack, depth, site_locals, &work);
+              terminated = true;
+              break;
+            case OP_ARETURN:
+              escaping |= site_stack[--depth];
+              terminated = true;
+              break;
+            case OP_IRETURN:
+            case OP_RETURN:
+              terminated = true;
+              break;
+            case OP_PUTSTATIC:
+              ip += 2;
+              escaping |= site_stack[--depth];
+              break;
+            case OP_INVOKEVIRTUAL:
+            case OP_INVOKESPECIAL:
+            case OP_INVOKESTATIC: {
+              CP_Info &ref = get_cp_info(fetch_u16());
+              NType *type = type_table.get(get_member_descriptor(ref.name_and_type_index).utf8);
+              u8 popped = type->parameters.length + (opcode != OP_INVOKESTATIC);
+              for (u8 i = 0; i < popped; ++i) {
+                escaping |= site_stack[--depth];
+              }
+              if (type->return_type->type != NType::VOID) {
+                site_stack[depth++] = 0;
+              }
+            }
+              break;
+            default:
+              /* the translation doesn't know it either */
+              escaping = ~0ull;
+              work.reset();
+              terminated = true;
+              break;
+          }
+
+          if (!terminated) {
+            Block *next = control_flow.find(ip - ci.code);
+            if (next) {
+              merge_sites(next, entries, site_stack, depth, site_locals, &work);
+              terminated = true;
+            }
+          }
+        }
+      }
+
+      for (auto &entry: array_sites) {
+        stack_sites |= 1ull << entry.second;
+      }
+      stack_sites &= ~escaping;
+
+      for (s64 i = 0; i < control_flow.blocks.length; ++i) {
+        free(entries[i].stack);
+        free(entries[i].locals);
+      }
+      delete[] entries;
+      free(site_stack);
+      free(site_locals);
+    }
+
+    /* Joins the sites along an edge into target, which is analyzed (again) if
+       that added any */
+    void merge_sites(Block *target, Site_State *entries, u64 *site_stack, u8 depth, u64 *site_locals, Array<Block *> *work) {
+      Site_State *entry = &entries[target - control_flow.blocks.data];
+      if (!entry->reached) {
+        entry->reached = true;
+        entry->sp = depth;
+        entry->stack = (u64 *) malloc((depth + 1) * sizeof(u64));
+        entry->locals = (u64 *) malloc((max_locals + 1) * sizeof(u64));
+        memcpy(entry->stack, site_stack, depth * sizeof(u64));
+        memcpy(entry->locals, site_locals, max_locals * sizeof(u64));
+        work->add(target);
+        return;
+      }
+
+      bool changed = false;
+      for (u8 i = 0; i < depth; ++i) {
+        changed |= (site_stack[i] & ~entry->stack[i]) != 0;
+        entry->stack[i] |= site_stack[i];
+      }
+      for (u16 i = 0; i < max_locals; ++i) {
+        changed |= (site_locals[i] & ~entry->locals[i]) != 0;
+        entry->locals[i] |= site_locals[i];
+      }
+      if (changed) {
+        work->add(target);
+      }
+    }
+
+    void convert_block(Block *b, Code ci) {
+      irb->SetInsertPoint(b->block);
+
+      sp = b->entry.sp;
+      memcpy(stack, b->entry.stack, sp * sizeof(JavaValue));
+      memcpy(locals, b->entry.locals, max_locals * sizeof(JavaValue));
+
+      ip = ci.code + b->offset;
       while (ip < ci.code + ci.code_length) {
         convert_opcode();
+
+        if (irb->GetInsertBlock()->getTerminator()) {
+          return;
+        }
+
+        Block *next = control_flow.find(ip - ci.code);
+        if (next) {
+          branch_to(next);
+          return;
+        }
       }
     }
 
-    Function *convert_function_header(Method *m) {
+    void branch_to(Block *target) {
+      add_edge(target);
+      irb->CreateBr(target->block);
+    }
+
+    /* Passes the current state along the edge from the insert block to target */
+    void add_edge(Block *target) {
+      BasicBlock *from = irb->GetInsertBlock();
+      FrameState *entry = &target->entry;
+
+      if (!target->reached) {
+        target->reached = true;
+        entry->sp = sp;
+        entry->stack = (JavaValue *) malloc(sp * sizeof(JavaValue));
+        entry->locals = (JavaValue *) malloc(max_locals * sizeof(JavaValue));
+
+        for (u8 i = 0; i < sp; ++i) {
+          entry->stack[i] = make_phi(stack[i], target->block);
+        }
+        for (u16 i = 0; i < max_locals; ++i) {
+          entry->locals[i] = make_phi(locals[i], target->block);
+        }
+
+        worklist.add(target);
+      }
+
+      assert(entry->sp == sp);
+      for (u8 i = 0; i < sp; ++i) {
+        add_incoming(entry->stack[i], stack[i], from);
+      }
+      for (u16 i = 0; i < max_locals; ++i) {
+        add_incoming(entry->locals[i], locals[i], from);
+      }
+    }
+
+    JavaValue make_phi(JavaValue v, BasicBlock *bb) {
+      if (v.llvm_ref) {
+        v.llvm_ref = PHINode::Create(v.llvm_ref->getType(), 2, "", bb);
+      }
+      if (v.length) {
+        v.length = PHINode::Create(v.length->getType(), 2, "", bb);
+      }
+      return v;
+    }
+
+    /* Slots whose type differs from the one the phi was created for can't be used
+       after the join (the verifier would reject that), so they just merge undef.
+       Arrays merge null instead, they may still be spilled to a root. */
+    void add_incoming(JavaValue phi, JavaValue v, BasicBlock *from) {
+      bool same = v.type == phi.type && v.array_type == phi.array_type;
+
+      if (phi.llvm_ref) {
+        Value *other = phi.type == JavaValue::ARRAY ? Constant::getNullValue(phi.llvm_ref->getType()) : UndefValue::get(phi.llvm_ref->getType());
+        Value *in = same && v.llvm_ref ? v.llvm_ref : other;
+        cast<PHINode>(phi.llvm_ref)->addIncoming(in, from);
+      }
+      if (phi.length) {
+        /* the length of an array from elsewhere is read on the edge */
+        Value *in = same && v.llvm_ref ? array_length(v) : UndefValue::get(phi.length->getType());
+        cast<PHINode>(phi.length)->addIncoming(in, from);
+      }
+    }
+
+    /* Phis are created for every slot defined at a join point, most of them end up
+       merging a single value (or nothing that is used) */
+    void remove_trivial_phis() {
+      bool changed = true;
+      while (changed) {
+        changed = false;
+
+        for (auto &bb: *function) {
+          for (auto it = bb.begin(); it != bb.end();) {
+            PHINode *phi = dyn_cast<PHINode>(&*it++);
+            if (!phi) {
+              break;
+            }
+
+            if (phi->use_empty()) {
+              phi->eraseFromParent();
+              changed = true;
+            } else if (Value *v = phi->hasConstantValue()) {
+              phi->replaceAllUsesWith(v);
+              phi->eraseFromParent();
+              changed = true;
+            }
+          }
+        }
+      }
+    }
+
+    FunctionType *convert_function_type(Method *m) {
       Type *ret_type = convert_type(m->type->return_type);
 
       Array<Type *> params;
       for (auto pty: m->type->parameters) {
-        if (pty->type == NType::INT) {
+        if (is_passed(pty)) {
           params.add(convert_type(pty));
         }
       }
 
-      String fn_name = clazz->name + to_string(".") + m->name;
+      return FunctionType::get(ret_type, ArrayRef(params.data, params.length), false);
+    }
+
+    Function *convert_function_header(Method *m) {
+      String fn_name = method_body_name(m);
 
-      auto fty = FunctionType::get(ret_type, ArrayRef(params.data, params.length), false);
-      auto fn = Function::Create(fty, Function::ExternalLinkage, STR_REF(fn_name), *module);
+      auto fn = Function::Create(convert_function_type(m), Function::ExternalLinkage, STR_REF(fn_name), *module);
+      fn->setDoesNotThrow();
+      function = fn;
 
       BasicBlock *bb = BasicBlock::Create(context, "", fn);
       irb->SetInsertPoint(bb);
@@ -697,36 +1352,38 @@ namespace jit {
     }
 
     void function_setup(Code ci) {
-      stack_int = (Value **) malloc(ci.max_stack * sizeof(Value *));
-      locals_int = (Value **) malloc(ci.max_locals * sizeof(Value *));
+      stack = (JavaValue *) malloc(ci.max_stack * sizeof(JavaValue));
+      locals = (JavaValue *) malloc(ci.max_locals * sizeof(JavaValue));
+      max_locals = ci.max_locals;
+      roots = (AllocaInst **) calloc(ci.max_locals + ci.max_stack, sizeof(AllocaInst *));
 
-      stack_object = (JavaObject *) malloc(ci.max_stack * sizeof(JavaArray));
-      locals_object = (JavaObject *) malloc(ci.max_locals * sizeof(JavaArray));
+      for (u16 i = 0; i < ci.max_locals; ++i) {
+        locals[i] = JavaValue();
+      }
 
       ip = ci.code;
       sp = 0;
+    }
 
-      for (u16 i = 0; i < ci.max_stack; ++i) {
-        AllocaInst *ia = irb->CreateAlloca(llty_i64, 0, "s_i_" + std::to_string(i));
-        stack_int[i] = ia;
-
-        AllocaInst *aa = irb->CreateAlloca(llty_i8_ptr, 0, "s_a_" + std::to_string(i));
-        stack_object[i].array.llvm_ref = aa;
+    /* Equal types are the same NType (see Type_Table), so they are converted
+       once per module */
+    Type *convert_type(NType *type) {
+      auto it = converted_types.find(type);
+      if (it != converted_types.end()) {
+        return it->second;
       }
 
-      for (u16 i = 0; i < ci.max_locals; ++i) {
-        AllocaInst *ia = irb->CreateAlloca(llty_i64, 0, "l_i_" + std::to_string(i));
-        locals_int[i] = ia;
-
-        AllocaInst *aa = irb->CreateAlloca(llty_i8_ptr, 0, "l_a_" + std::to_string(i));
-        locals_object[i].array.llvm_ref = aa;
-      }
+      /* converting element types may grow the map, so no reference into it */
+      Type *converted = convert_type_uncached(type);
+      converted_types[type] = converted;
+      return converted;
     }
 
-    Type *convert_type(NType *type) {
+    Type *convert_type_uncached(NType *type) {
       switch (type->type) {
+        /* pointer to the Array_Object */
         case NType::ARRAY:
-          return convert_type(type->element_type)->getPointerTo();
+          return llty_i8_ptr;
         case NType::CLASS: {
           if (type->clazz_name == "java/lang/String") {
             return llty_i8->getPointerTo();
@@ -776,49 +1433,48 @@ namespace jit {
     }
 
     void create_cond_jump(CmpInst::Predicate op, Value *l, Value *r, u16 off) {
-      BasicBlock *after = BasicBlock::Create(context, "", method->llvm_ref);
-
-      BasicBlock *target = get_or_create_block(off);
+      Block *target = control_flow.find(off);
+      Block *after = control_flow.find(ip - method->code.code);
 
       Value *cmp = irb->CreateICmp(op, l, r);
-      irb->CreateCondBr(cmp, target, after);
-
-      SetInsertBlock(after);
+      add_edge(target);
+      add_edge(after);
+      irb->CreateCondBr(cmp, target->block, after->block);
     }
 
-    BasicBlock *get_or_create_block(u16 off) {
-      BasicBlock *bb = control_flow.find(off);
-
-      if (!bb) {
-        bb = BasicBlock::Create(context, "", method->llvm_ref);
-        control_flow.add(off, bb);
+    void get_or_create_block(u16 off) {
+      if (!control_flow.find(off)) {
+        control_flow.add(off, BasicBlock::Create(context, "", function));
       }
-
-      return bb;
     }
 
-    void push_int(Value *val) {
-      llvm_store_int(val, stack_int[sp++]);
+    void push(JavaValue v) {
+      stack[sp++] = v;
     }
 
-    Value *pop_int() {
-      return load(stack_int[--sp]);
+    JavaValue pop() {
+      return stack[--sp];
     }
 
-    void store_int(u8 index, Value *value) {
-      llvm_store_int(value, locals_int[index]);
+    void push_int(Value *val) {
+      JavaValue v;
+      v.type = JavaValue::INT;
+      v.llvm_ref = irb->CreateIntCast(val, llty_i64, true);
+      push(v);
     }
 
-    void store_int(u8 index) {
-      store_int(index, pop_int());
+    Value *pop_int() {
+      JavaValue v = pop();
+      assert(v.type == JavaValue::INT);
+      return v.llvm_ref;
     }
 
-    void load_int(u8 index) {
-      push_int(load_local_int(index));
+    void store(u8 index) {
+      locals[index] = pop();
     }
 
-    Value *load_local_int(u8 index) {
-      return load(locals_int[index]);
+    void load(u8 index) {
+      push(locals[index]);
     }
 
     /* converts between different int types automatically */
@@ -828,92 +1484,230 @@ namespace jit {
       irb->CreateStore(irb->CreateIntCast(val, ptr_el_ty, true), ptr);
     }
 
-    void push_array(Value *ptr, u8 type, Value *length) {
-      JavaObject *obj = &stack_object[sp++];
-      JavaArray *arr = &obj->array;
+    /* length only when known at compile time, see array_length() */
+    void push_array(Value *ptr, u8 type, Value *length = 0) {
+      JavaValue v;
+      v.type = JavaValue::ARRAY;
+      v.llvm_ref = ptr;
+      v.length = length;
+      v.array_type = type;
+      push(v);
+    }
 
-      obj->type = JavaObject::ARRAY;
-      arr->type = type;
-      arr->length = length;
+    /* The length of an array never changes after allocation, so the load of it
+       from the header can be reused and hoisted freely */
+    Value *array_length(JavaValue arr) {
+      if (arr.length) {
+        return arr.length;
+      }
 
-      irb->CreateStore(ptr, arr->llvm_ref);
+      Value *p = irb->CreateConstInBoundsGEP1_64(llty_i8, arr.llvm_ref, offsetof(Array_Object, length));
+      LoadInst *length = irb->CreateLoad(llty_i32, irb->CreateBitCast(p, llty_i32->getPointerTo()));
+      length->setMetadata(LLVMContext::MD_invariant_load, MDNode::get(context, {}));
+      return irb->CreateSExt(length, llty_i64);
     }
 
-    JavaArray *pop_array() {
-      return &stack_object[--sp].array;
+    /* Bumps the TLAB pointer of the thread (see heap.cpp) for arrays that fit
+       into a TLAB, anything else (a full TLAB, big or negative lengths) goes
+       through new_array(). TLABs are zeroed, only the header is written. */
+    Value *allocate_array(Value *length, u8 type) {
+      s64 element_size = array_type_size(type);
+      Value *size = irb->CreateAnd(irb->CreateAdd(irb->CreateMul(length, make_int(element_size)), make_int(sizeof(Array_Object) + 7)), make_int(~7ll));
+
+      /* the same on every call in the thread, so it is hoisted and shared */
+      Function *tlab_fn = get_runtime_function("njvm_current_tlab", llty_i8_ptr, {});
+      tlab_fn->setDoesNotAccessMemory();
+      tlab_fn->setDoesNotThrow();
+      tlab_fn->addFnAttr(llvm::Attribute::WillReturn);
+      Value *tlab = irb->CreateBitCast(irb->CreateCall(tlab_fn), llty_i8_ptr->getPointerTo());
+      Value *top_ptr = gep(tlab, {make_int(offsetof(Tlab, top) / sizeof(u8 *))});
+      Value *end_ptr = gep(tlab, {make_int(offsetof(Tlab, end) / sizeof(u8 *))});
+      Value *top = load(top_ptr);
+      Value *end = load(end_ptr);
+
+      Value *small = irb->CreateICmpULE(length, make_int((TLAB_MAX_OBJECT - sizeof(Array_Object)) / element_size));
+      Value *fits = irb->CreateICmpULE(size, irb->CreatePtrDiff(llty_i8, end, top));
+      BasicBlock *fast = BasicBlock::Create(context, "", function);
+      BasicBlock *slow = BasicBlock::Create(context, "", function);
+      BasicBlock *done = BasicBlock::Create(context, "", function);
+      irb->CreateCondBr(irb->CreateAnd(small, fits), fast, slow, MDBuilder(context).createBranchWeights(1 << 20, 1));
+
+      irb->SetInsertPoint(fast);
+      irb->CreateStore(irb->CreateInBoundsGEP(llty_i8, top, size), top_ptr);
+      store_array_header(top, length, type);
+      irb->CreateBr(done);
+
+      /* a new TLAB may need a collection */
+      FrameState before = copy_state();
+      irb->SetInsertPoint(slow);
+      spill_roots();
+      Function *new_array_fn = get_runtime_function("new_array", llty_i8_ptr, {llty_i64, llty_i64});
+      Value *allocated = irb->CreateCall(new_array_fn, {length, make_int(type)});
+      reload_roots();
+      irb->CreateBr(done);
+
+      irb->SetInsertPoint(done);
+      PHINode *array = irb->CreatePHI(llty_i8_ptr, 2);
+      array->addIncoming(top, fast);
+      array->addIncoming(allocated, slow);
+      merge_roots(before, fast, slow);
+      return array;
     }
 
-    void store_array(u8 index, Value *ptr, u8 type, Value *length) {
-      JavaObject *obj = &locals_object[index];
-      JavaArray *arr = &obj->array;
+    void store_array_header(Value *array, Value *length, u8 type) {
+      irb->CreateStore(ConstantInt::get(llty_i8, type), irb->CreateConstInBoundsGEP1_64(llty_i8, array, offsetof(Array_Object, type)));
+      Value *length_ptr = irb->CreateBitCast(irb->CreateConstInBoundsGEP1_64(llty_i8, array, offsetof(Array_Object, length)), llty_i32->getPointerTo());
+      irb->CreateStore(irb->CreateTrunc(length, llty_i32), length_ptr);
+    }
 
-      obj->type = JavaObject::ARRAY;
-      arr->type = type;
-      arr->length = length;
+    /* Whether the NEWARRAY at offset can allocate in the frame: its arrays
+       don't escape (see find_stack_arrays()) and have a small constant length */
+    bool is_stack_array(u16 offset, Value *length, u8 type) {
+      auto it = array_sites.find(offset);
+      ConstantInt *constant = dyn_cast<ConstantInt>(length);
+      if (it == array_sites.end() || !(stack_sites >> it->second & 1) || !constant) {
+        return false;
+      }
 
-      irb->CreateStore(ptr, arr->llvm_ref);
+      s64 n = constant->getSExtValue();
+      return n >= 0 && array_size(n, type) <= STACK_ARRAY_MAX;
     }
 
-    void store_array(u8 index) {
-      JavaArray *arr = pop_array();
-      store_array(index, load(arr->llvm_ref), arr->type, arr->length);
+    /* The array lives in a buffer of the frame, one per NEWARRAY, which is
+       zeroed on every allocation like a TLAB is. With constant indices SROA
+       turns the elements into plain SSA values and the array disappears. */
+    Value *allocate_stack_array(Value *length, u8 type) {
+      u64 size = array_size(cast<ConstantInt>(length)->getSExtValue(), type);
+
+      BasicBlock &entry = function->getEntryBlock();
+      IRBuilder<> builder(&entry, entry.begin());
+      AllocaInst *buffer = builder.CreateAlloca(ArrayType::get(llty_i8, size));
+      buffer->setAlignment(Align(8));
+
+      Value *array = irb->CreateBitCast(buffer, llty_i8_ptr);
+      irb->CreateMemSet(array, ConstantInt::get(llty_i8, 0), size, MaybeAlign(8));
+      store_array_header(array, length, type);
+      return array;
     }
 
-    void load_array(u8 index) {
-      JavaArray *arr = &locals_object[index].array;
-
-      push_array(load(arr->llvm_ref), arr->type, arr->length);
+    /* Slot of the shadow stack (see heap.cpp) for the frame slot at position,
+       locals first and then the operand stack. Slots are created on first use
+       and start out null, a method without safepoints doesn't get any. */
+    AllocaInst *get_root(u32 position) {
+      if (!roots[position]) {
+        BasicBlock &entry = function->getEntryBlock();
+        IRBuilder<> builder(&entry, entry.begin());
+        AllocaInst *root = builder.CreateAlloca(llty_i8_ptr);
+        Function *gcroot = Intrinsic::getDeclaration(module.get(), Intrinsic::gcroot);
+        builder.CreateCall(gcroot, {root, Constant::getNullValue(llty_i8_ptr)});
+        builder.CreateStore(Constant::getNullValue(llty_i8_ptr), root);
+
+        function->setGC("shadow-stack");
+        roots[position] = root;
+      }
+      return roots[position];
     }
 
-    void load_object(u8 index) {
-      JavaObject *o = &locals_object[index];
-      if (o->type == JavaObject::ARRAY) {
-        load_array(index);
-      } else if (o->type == JavaObject::CLASS) {
-        load_class(index);
+    /* Calls that may collect are safepoints: the arrays in the frame are stored
+       to their roots before the call and reloaded after it, the collector may
+       have moved them. Roots of slots that hold something else now keep their
+       old array, that only keeps it alive a little longer. */
+    void spill_roots() {
+      for (u16 i = 0; i < max_locals; ++i) {
+        if (needs_root(locals[i])) {
+          irb->CreateStore(locals[i].llvm_ref, get_root(i));
+        }
+      }
+      for (u8 i = 0; i < sp; ++i) {
+        if (needs_root(stack[i])) {
+          irb->CreateStore(stack[i].llvm_ref, get_root(max_locals + i));
+        }
       }
     }
 
-    void store_object(u8 index) {
-      JavaObject *o = &locals_object[index];
-      if (o->type == JavaObject::ARRAY) {
-        store_array(index);
-      } else if (o->type == JavaObject::CLASS) {
-        store_class(index);
+    void reload_roots() {
+      for (u16 i = 0; i < max_locals; ++i) {
+        if (needs_root(locals[i])) {
+          locals[i].llvm_ref = irb->CreateLoad(llty_i8_ptr, get_root(i));
+        }
+      }
+      for (u8 i = 0; i < sp; ++i) {
+        if (needs_root(stack[i])) {
+          stack[i].llvm_ref = irb->CreateLoad(llty_i8_ptr, get_root(max_locals + i));
+        }
       }
     }
 
-    JavaObject *pop_object() {
-      return &stack_object[--sp];
+    /* Arrays in the frame (see allocate_stack_array()) never move, that keeps
+       them out of memory so they can be split up. Merged with heap arrays they
+       are spilled anyway, the collector ignores pointers outside the heap. */
+    bool needs_root(JavaValue v) {
+      return v.type == JavaValue::ARRAY && !isa<AllocaInst>(v.llvm_ref->stripPointerCasts());
     }
 
-    void push_class(String name) {
-      JavaObject *obj = &stack_object[sp++];
-      obj->type = JavaObject::CLASS;
-      obj->name = name;
+    FrameState copy_state() {
+      FrameState state;
+      state.sp = sp;
+      state.stack = (JavaValue *) malloc(sp * sizeof(JavaValue));
+      state.locals = (JavaValue *) malloc(max_locals * sizeof(JavaValue));
+      memcpy(state.stack, stack, sp * sizeof(JavaValue));
+      memcpy(state.locals, locals, max_locals * sizeof(JavaValue));
+      return state;
     }
 
-    void store_class(u8 index) {
-      JavaObject *o = pop_object();
-      locals_object[index].name = o->name;
-      locals_object[index].type = JavaObject::CLASS;
+    /* Joins the path that reloaded the arrays after a safepoint (slow) with the
+       one that didn't (fast, whose state was before), the insert block is the
+       join. before is released. */
+    void merge_roots(FrameState before, BasicBlock *fast, BasicBlock *slow) {
+      for (u16 i = 0; i < max_locals; ++i) {
+        merge_root(&locals[i], before.locals[i], fast, slow);
+      }
+      for (u8 i = 0; i < sp; ++i) {
+        merge_root(&stack[i], before.stack[i], fast, slow);
+      }
+
+      free(before.stack);
+      free(before.locals);
+    }
+
+    void merge_root(JavaValue *v, JavaValue before, BasicBlock *fast, BasicBlock *slow) {
+      if (v->type != JavaValue::ARRAY || v->llvm_ref == before.llvm_ref) {
+        return;
+      }
+
+      PHINode *phi = irb->CreatePHI(llty_i8_ptr, 2);
+      phi->addIncoming(before.llvm_ref, fast);
+      phi->addIncoming(v->llvm_ref, slow);
+      v->llvm_ref = phi;
     }
 
-    void load_class(u8 index) {
-      JavaObject *obj = &locals_object[index];
-      push_class(obj->name);
+    /* Stops the program unless 0 <= index < length, one unsigned compare covers
+       negative indices too. The failing path is a cold call that doesn't
+       return, checks range analysis proves redundant are removed again by
+       BoundsCheckElimination. */
+    void check_bounds(JavaValue arr, Value *index) {
+      Value *length = array_length(arr);
+      Value *in_bounds = irb->CreateICmpULT(index, length);
+
+      BasicBlock *fail = BasicBlock::Create(context, "", function);
+      BasicBlock *ok = BasicBlock::Create(context, "", function);
+      irb->CreateCondBr(in_bounds, ok, fail, MDBuilder(context).createBranchWeights(1 << 20, 1));
+
+      irb->SetInsertPoint(fail);
+      Function *fail_fn = get_runtime_function("njvm_index_out_of_bounds", llty_void, {llty_i64, llty_i64});
+      fail_fn->setDoesNotReturn();
+      fail_fn->addFnAttr(llvm::Attribute::Cold);
+      irb->CreateCall(fail_fn, {index, length});
+      irb->CreateUnreachable();
+
+      irb->SetInsertPoint(ok);
     }
 
-    void optimize() {
-      legacy::PassManager *pm = new legacy::PassManager();
-      PassManagerBuilder pmb;
-      pmb.OptLevel = 2;
-      pmb.SizeLevel = 0;
-      pmb.DisableUnrollLoops = false;
-      pmb.LoopVectorize = true;
-      pmb.SLPVectorize = true;
-      pmb.populateModulePassManager(*pm);
-      pm->run(*module);
+    /* Address of the element at index, the elements follow the header */
+    Value *array_element(JavaValue arr, Value *index) {
+      Value *data = irb->CreateConstInBoundsGEP1_64(llty_i8, arr.llvm_ref, sizeof(Array_Object));
+      Value *elements = irb->CreateBitCast(data, java_to_llvm_type(arr.array_type)->getPointerTo());
+      return gep(elements, index);
     }
 
     Value *make_int(s64 v) {
@@ -931,4 +1725,436 @@ namespace jit {
       return load;
     }
   };
+
+  /* Removes the bounds checks (see Translator::check_bounds()) whose index
+     scalar evolution proves to be in range where they are, typically the
+     induction variable of for (i = 0; i < a.length; i++). Runs right before
+     the vectorizer, loops are rotated by then and don't keep their checks. */
+  struct BoundsCheckElimination : PassInfoMixin<BoundsCheckElimination> {
+    PreservedAnalyses run(Function &f, FunctionAnalysisManager &fam) {
+      ScalarEvolution &se = fam.getResult<ScalarEvolutionAnalysis>(f);
+      bool changed = false;
+
+      for (auto &bb: f) {
+        BranchInst *br = dyn_cast<BranchInst>(bb.getTerminator());
+        ICmpInst *cmp = br && br->isConditional() ? dyn_cast<ICmpInst>(br->getCondition()) : 0;
+        if (!cmp) {
+          continue;
+        }
+
+        /* optimizations may have inverted the compare */
+        u32 fail;
+        if (is_bounds_failure(br->getSuccessor(1))) {
+          fail = 1;
+        } else if (is_bounds_failure(br->getSuccessor(0))) {
+          fail = 0;
+        } else {
+          continue;
+        }
+
+        ICmpInst::Predicate pred = fail == 1 ? cmp->getPredicate() : cmp->getInversePredicate();
+        const SCEV *l = se.getSCEV(cmp->getOperand(0));
+        const SCEV *r = se.getSCEV(cmp->getOperand(1));
+        if (!in_range(se, pred, l, r, br)) {
+          continue;
+        }
+
+        br->getSuccessor(fail)->removePredecessor(&bb);
+        BranchInst::Create(br->getSuccessor(1 - fail), br);
+        br->eraseFromParent();
+        if (cmp->use_empty()) {
+          cmp->eraseFromParent();
+        }
+        changed = true;
+      }
+
+      return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    }
+
+    static bool is_bounds_failure(BasicBlock *bb) {
+      CallInst *call = dyn_cast<CallInst>(bb->getFirstNonPHI());
+      Function *fn = call ? call->getCalledFunction() : 0;
+      return fn && fn->getName() == "njvm_index_out_of_bounds";
+    }
+
+    /* Indices and lengths are sign extended ints. Loop conditions compare them
+       signed, which proves the unsigned check once the index is non-negative. */
+    static bool in_range(ScalarEvolution &se, ICmpInst::Predicate pred, const SCEV *l, const SCEV *r, Instruction *at) {
+      if (se.isKnownPredicateAt(pred, l, r, at)) {
+        return true;
+      }
+      return ICmpInst::isUnsigned(pred) && se.isKnownNonNegative(l) && se.isKnownNonNegative(r)
+             && se.isKnownPredicateAt(ICmpInst::getSignedPredicate(pred), l, r, at);
+    }
+  };
+
+  struct Jit : Backend {
+    Options *options;
+    std::unique_ptr<JITTargetMachineBuilder> jtmb;
+    std::unique_ptr<CodeCache> code_cache;
+    /* declared before lljit so they outlive it, its destructor waits for compiles
+       still running in the background, which may use them */
+    std::unique_ptr<LazyCallThroughManager> lctm;
+    std::unique_ptr<IndirectStubsManager> ism;
+    std::unique_ptr<LLJIT> lljit;
+    /* holds the method bodies, the main dylib only holds the stubs pointing at them */
+    JITDylib *bodies;
+    std::mutex output_lock;
+
+    Jit(Class *main_clazz, Options *options) : Backend(main_clazz), options(options) {
+      InitializeNativeTarget();
+      InitializeNativeTargetAsmPrinter();
+      InitializeNativeTargetAsmParser();
+      /* compiled code keeps its roots on the "shadow-stack" GC */
+      linkAllBuiltinGCs();
+
+      jtmb = std::make_unique<JITTargetMachineBuilder>(check(JITTargetMachineBuilder::detectHost()));
+      jtmb->setCodeGenOptLevel(codegen_opt_level());
+
+      if (options->cache_dir) {
+        code_cache = std::make_unique<CodeCache>(options->cache_dir, jtmb->getCPU(), jtmb->getFeatures().getString(), options->opt_level);
+      }
+
+      /* with compile threads, materialization (translation, optimization and codegen
+         of a method) runs on a pool, each method in its own context */
+      lljit = check(LLJITBuilder()
+        .setJITTargetMachineBuilder(*jtmb)
+        .setNumCompileThreads(options->jobs)
+        .setCompileFunctionCreator([this](JITTargetMachineBuilder jtmb) -> Expected<std::unique_ptr<IRCompileLayer::IRCompiler>> {
+          return std::make_unique<ConcurrentIRCompiler>(std::move(jtmb), code_cache.get());
+        })
+        .create());
+      lljit->getIRTransformLayer().setTransform([this](ThreadSafeModule tsm, const MaterializationResponsibility &) {
+        tsm.withModuleDo([this](Module &m) { optimize(m); });
+        return Expected<ThreadSafeModule>(std::move(tsm));
+      });
+      ExecutionSession &es = lljit->getExecutionSession();
+      const Triple &triple = lljit->getTargetTriple();
+
+      lctm = check(createLocalLazyCallThroughManager(triple, es, pointerToJITTargetAddress(&lazy_compile_failed)));
+      ism = createLocalIndirectStubsManagerBuilder(triple)();
+
+      bodies = &check(lljit->createJITDylib("njvm-bodies"));
+      bodies->addToLinkOrder(lljit->getMainJITDylib());
+
+      // TODO: move somewhere else later
+      void (*print_int_ptr)(s64) = print_int;
+      Array_Object *(*new_array_ptr)(s64, s64) = new_array;
+      void (*initialize_class_ptr)(Class *) = njvm_initialize_class;
+      void (*index_out_of_bounds_ptr)(s64, s64) = njvm_index_out_of_bounds;
+      Tlab *(*current_tlab_ptr)() = njvm_current_tlab;
+      /* the shadow stack lowering gives every module a weak definition of
+         llvm_gc_root_chain, which gives way to this one in both dylibs */
+      check(bodies->define(absoluteSymbols({
+        {lljit->mangleAndIntern("llvm_gc_root_chain"), JITEvaluatedSymbol(pointerToJITTargetAddress(&gc_root_chain), JITSymbolFlags::Exported)},
+      })));
+      check(lljit->getMainJITDylib().define(absoluteSymbols({
+        {lljit->mangleAndIntern("llvm_gc_root_chain"), JITEvaluatedSymbol(pointerToJITTargetAddress(&gc_root_chain), JITSymbolFlags::Exported)},
+        {lljit->mangleAndIntern("print_int"), JITEvaluatedSymbol(pointerToJITTargetAddress(print_int_ptr), JITSymbolFlags::Exported)},
+        {lljit->mangleAndIntern("new_array"), JITEvaluatedSymbol(pointerToJITTargetAddress(new_array_ptr), JITSymbolFlags::Exported)},
+        {lljit->mangleAndIntern("njvm_initialize_class"), JITEvaluatedSymbol(pointerToJITTargetAddress(initialize_class_ptr), JITSymbolFlags::Exported)},
+        {lljit->mangleAndIntern("njvm_index_out_of_bounds"), JITEvaluatedSymbol(pointerToJITTargetAddress(index_out_of_bounds_ptr), JITSymbolFlags::Exported)},
+        {lljit->mangleAndIntern("njvm_current_tlab"), JITEvaluatedSymbol(pointerToJITTargetAddress(current_tlab_ptr), JITSymbolFlags::Exported)},
+      })));
+
+      /* classes loaded later are added when the translation of a method first
+         refers to them */
+      std::lock_guard<std::recursive_mutex> guard(class_registry.lock);
+      for (auto c: class_registry.loaded) {
+        add_class(c);
+      }
+      class_registry.on_load = [this](Class *c) { add_class(c); };
+    }
+
+    template<typename T>
+    T check(Expected<T> value) {
+      if (!value) {
+        logAllUnhandledErrors(value.takeError(), errs(), "njvm: ");
+        exit(1);
+      }
+      return std::forward<T>(*value);
+    }
+
+    void check(Error err) {
+      if (err) {
+        logAllUnhandledErrors(std::move(err), errs(), "njvm: ");
+        exit(1);
+      }
+    }
+
+    /* Static fields resolve to their storage in Field, methods only get a lazy
+       stub which translates and compiles the method on its first call. */
+    void add_class(Class *clazz) {
+      SymbolMap statics;
+      String class_symbol = clazz->name + to_string(".$class");
+      String state_symbol = clazz->name + to_string(".$init_state");
+      statics[lljit->mangleAndIntern(STR_REF(class_symbol))] = JITEvaluatedSymbol(pointerToJITTargetAddress(clazz), JITSymbolFlags::Exported);
+      statics[lljit->mangleAndIntern(STR_REF(state_symbol))] = JITEvaluatedSymbol(pointerToJITTargetAddress(&clazz->init_state), JITSymbolFlags::Exported);
+      for (u16 i = 0; i < clazz->fields_count; ++i) {
+        Field *f = &clazz->fields[i];
+        String name = clazz->name + to_string(".") + f->name;
+        statics[lljit->mangleAndIntern(STR_REF(name))] = JITEvaluatedSymbol(pointerToJITTargetAddress(&f->static_value), JITSymbolFlags::Exported);
+      }
+      check(lljit->getMainJITDylib().define(absoluteSymbols(std::move(statics))));
+
+      SymbolAliasMap stubs;
+      SymbolLookupSet body_names;
+      for (u16 i = 0; i < clazz->methods_count; ++i) {
+        Method *m = &clazz->methods[i];
+        auto flags = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+        auto body_name = lljit->mangleAndIntern(STR_REF(method_body_name(m)));
+
+        SymbolFlagsMap symbols({{body_name, flags}});
+        if (method_has_adapter(m)) {
+          symbols[lljit->mangleAndIntern(STR_REF(method_adapter_name(m)))] = flags;
+        }
+
+        check(bodies->define(std::make_unique<MethodMaterializationUnit>(this, m, std::move(symbols))));
+        stubs[lljit->mangleAndIntern(STR_REF(method_name(m)))] = SymbolAliasMapEntry(body_name, flags);
+        body_names.add(body_name);
+      }
+      check(lljit->getMainJITDylib().define(lazyReexports(*lctm, *ism, *bodies, std::move(stubs))));
+
+      if (options->precompile) {
+        compile_in_background(std::move(body_names));
+      }
+    }
+
+    /* Requests the bodies without waiting for them. Every method is its own
+       materialization unit, so the compile threads work on them in parallel while
+       the program starts running; a stub called before its method is done just
+       waits for it. Results are only ever bound by symbol name, so the order in
+       which the threads finish doesn't matter. */
+    void compile_in_background(SymbolLookupSet body_names) {
+      ExecutionSession &es = lljit->getExecutionSession();
+      es.lookup(LookupKind::Static, makeJITDylibSearchOrder(bodies), std::move(body_names), SymbolState::Ready,
+                [](Expected<SymbolMap> result) {
+                  if (!result) {
+                    logAllUnhandledErrors(result.takeError(), errs(), "njvm: ");
+                  }
+                }, NoDependenciesToRegister);
+    }
+
+    /* Compiles the OSR entry e of m in the background, e->code is set once it is
+       done. Every entry gets its own symbol in the bodies dylib. */
+    void compile_osr_async(Method *m, Osr_Entry *e) {
+      auto osr_name = lljit->mangleAndIntern(STR_REF(method_osr_name(m, e->offset)));
+      auto flags = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+      check(bodies->define(std::make_unique<MethodMaterializationUnit>(this, m, SymbolFlagsMap({{osr_name, flags}}), e)));
+
+      ExecutionSession &es = lljit->getExecutionSession();
+      es.lookup(LookupKind::Static, makeJITDylibSearchOrder(bodies), SymbolLookupSet(osr_name), SymbolState::Ready,
+                [e, osr_name](Expected<SymbolMap> result) {
+                  if (!result) {
+                    logAllUnhandledErrors(result.takeError(), errs(), "njvm: ");
+                    return;
+                  }
+                  void *code = jitTargetAddressToPointer<void *>((*result)[osr_name].getAddress());
+                  std::atomic_ref<void *>(e->code).store(code, std::memory_order_release);
+                }, NoDependenciesToRegister);
+    }
+
+    /* Compiles m in the background, once it is done m->native_code points at
+       the adapter of the method */
+    void compile_async(Method *m) {
+      assert(method_has_adapter(m));
+
+      auto adapter_name = lljit->mangleAndIntern(STR_REF(method_adapter_name(m)));
+      ExecutionSession &es = lljit->getExecutionSession();
+      es.lookup(LookupKind::Static, makeJITDylibSearchOrder(bodies), SymbolLookupSet(adapter_name), SymbolState::Ready,
+                [m, adapter_name](Expected<SymbolMap> result) {
+                  if (!result) {
+                    logAllUnhandledErrors(result.takeError(), errs(), "njvm: ");
+                    return;
+                  }
+                  void *code = jitTargetAddressToPointer<void *>((*result)[adapter_name].getAddress());
+                  std::atomic_ref<void *>(m->native_code).store(code, std::memory_order_release);
+                }, NoDependenciesToRegister);
+    }
+
+    void run() override {
+      /* static initializers run through their stubs like any other method */
+      class_registry.run_initializer = [this](Method *m) {
+        auto sym = check(lljit->lookup(STR_REF(method_name(m))));
+        void (*clinit)() = (void (*)()) sym.getAddress();
+        clinit();
+      };
+      class_registry.initialize(clazz);
+
+      /* Create main function */
+      Translator t(clazz, to_string("<main>"), lljit->getDataLayout());
+      auto main_ty = FunctionType::get(t.llty_i32, {}, false);
+      auto main_fn = Function::Create(main_ty, Function::ExternalLinkage, "main", *t.module);
+      BasicBlock *main_entry = BasicBlock::Create(t.context, "", main_fn);
+      t.irb->SetInsertPoint(main_entry);
+
+      /* change later to search all classes */
+      Method *main_method = find_main();
+      Function *main_body = t.get_function(main_method);
+      /* there are no command line arguments for the program, args is null */
+      t.irb->CreateCall(main_body, {Constant::getNullValue(main_body->getArg(0)->getType())});
+
+      t.irb->CreateRet(ConstantInt::get(t.llty_i32, 0));
+
+      finalize(t.finish());
+    }
+
+    void finalize(ThreadSafeModule tsm) {
+      if (!verify_module(tsm)) {
+        return;
+      }
+      check(lljit->addIRModule(std::move(tsm)));
+
+      auto main_sym = check(lljit->lookup("main"));
+      s32 (*main)() = (s32 (*)()) main_sym.getAddress();
+      main();
+    }
+
+    /* Called by MethodMaterializationUnit once the body of m is needed, possibly
+       on one of the compile threads */
+    void emit_method(std::unique_ptr<MaterializationResponsibility> r, Method *m) {
+      String name = method_body_name(m);
+
+      u64 hash = 0;
+      if (code_cache) {
+        hash = code_hash(m->clazz);
+        auto obj = code_cache->load(STR_REF(name), hash);
+        if (obj) {
+          lljit->getObjLinkingLayer().emit(std::move(r), std::move(obj));
+          return;
+        }
+      }
+
+      Translator t(m->clazz, name, lljit->getDataLayout(), m);
+      if (code_cache) {
+        t.module->addModuleFlag(Module::Warning, "njvm.code_hash", ConstantInt::get(t.llty_i64, hash));
+      }
+      t.run();
+      if (method_has_adapter(m)) {
+        t.convert_adapter(m);
+      }
+
+      ThreadSafeModule tsm = t.finish();
+      if (!verify_module(tsm)) {
+        r->failMaterialization();
+        return;
+      }
+      lljit->getIRTransformLayer().emit(std::move(r), std::move(tsm));
+    }
+
+    /* Compiled code depends on the classes it refers to as well (field offsets,
+       inlined methods, types), so the code cache key of the methods of c also
+       covers their class files. The classes are loaded (not initialized) for
+       that, which cached code needs anyway: classes are otherwise loaded while
+       translating the code referring to them, and cached code isn't
+       translated. Classes that aren't found contribute their name. */
+    u64 code_hash(Class *c) {
+      u64 hash = c->hash;
+      for (u16 i = 0; i < c->constant_pool_count - 1; ++i) {
+        CP_Info *info = &c->constant_pool[i];
+        if (info->tag != CONSTANT_Class) {
+          continue;
+        }
+
+        String name = c->constant_pool[info->name_index - 1].utf8;
+        Class *referenced = class_registry.find(name);
+        if (referenced) {
+          hash = hash_bytes(&referenced->hash, sizeof(referenced->hash), hash);
+        } else {
+          hash = hash_bytes(name.data, name.length, hash);
+        }
+      }
+      return hash;
+    }
+
+    /* OSR entries depend on the interpreter frame they were requested from, they
+       are not put into the code cache */
+    void emit_osr(std::unique_ptr<MaterializationResponsibility> r, Method *m, Osr_Entry *e) {
+      Translator t(m->clazz, method_osr_name(m, e->offset), lljit->getDataLayout(), m);
+      t.convert_osr(m, e);
+
+      ThreadSafeModule tsm = t.finish();
+      if (!verify_module(tsm)) {
+        r->failMaterialization();
+        return;
+      }
+      lljit->getIRTransformLayer().emit(std::move(r), std::move(tsm));
+    }
+
+    bool verify_module(ThreadSafeModule &tsm) {
+      return tsm.withModuleDo([this](Module &m) {
+        if (verifyModule(m, &outs())) {
+          std::lock_guard<std::mutex> lock(output_lock);
+          m.print(outs(), 0);
+          return false;
+        }
+        return true;
+      });
+    }
+
+    /* Runs the new pass manager pipeline for the selected -O level. Every method
+       lives in its own module, so this optimizes one function at a time. */
+    void optimize(Module &m) {
+      LoopAnalysisManager lam;
+      FunctionAnalysisManager fam;
+      CGSCCAnalysisManager cgam;
+      ModuleAnalysisManager mam;
+
+      /* target machines aren't shared between compile threads */
+      auto target_machine = check(jtmb->createTargetMachine());
+      PassBuilder pb(target_machine.get());
+      pb.registerModuleAnalyses(mam);
+      pb.registerCGSCCAnalyses(cgam);
+      pb.registerFunctionAnalyses(fam);
+      pb.registerLoopAnalyses(lam);
+      pb.crossRegisterProxies(lam, fam, cgam, mam);
+      pb.registerVectorizerStartEPCallback([](FunctionPassManager &fpm, OptimizationLevel) {
+        fpm.addPass(BoundsCheckElimination());
+        fpm.addPass(SimplifyCFGPass());
+      });
+
+      ModulePassManager mpm;
+      switch (options->opt_level) {
+        case 0:
+          mpm = pb.buildO0DefaultPipeline(OptimizationLevel::O0);
+          break;
+        case 1:
+          mpm = pb.buildPerModuleDefaultPipeline(OptimizationLevel::O1);
+          break;
+        case 2:
+          mpm = pb.buildPerModuleDefaultPipeline(OptimizationLevel::O2);
+          break;
+        default:
+          mpm = pb.buildPerModuleDefaultPipeline(OptimizationLevel::O3);
+          break;
+      }
+      mpm.run(m, mam);
+
+      if (options->dump_ir) {
+        std::lock_guard<std::mutex> lock(output_lock);
+        m.print(outs(), 0);
+      }
+    }
+
+    CodeGenOpt::Level codegen_opt_level() {
+      switch (options->opt_level) {
+        case 0:
+          return CodeGenOpt::None;
+        case 1:
+          return CodeGenOpt::Less;
+        case 2:
+          return CodeGenOpt::Default;
+        default:
+          return CodeGenOpt::Aggressive;
+      }
+    }
+  };
+
+  void MethodMaterializationUnit::materialize(std::unique_ptr<MaterializationResponsibility> r) {
+    if (osr) {
+      jit->emit_osr(std::move(r), method, osr);
+    } else {
+      jit->emit_method(std::move(r), method);
+    }
+  }
 }
\ No newline at end of file
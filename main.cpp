@@ -1,28 +1,49 @@
 #include <cassert>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <cstdlib>
 #include <cstring>
 
-#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <llvm/Analysis/ScalarEvolution.h>
 #include <llvm/ExecutionEngine/JITSymbol.h>
-#include <llvm/ExecutionEngine/MCJIT.h>
+#include <llvm/ExecutionEngine/ObjectCache.h>
 #include <llvm/ExecutionEngine/SectionMemoryManager.h>
 #include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
 #include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/IndirectionUtils.h>
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include <llvm/ExecutionEngine/Orc/LazyReexports.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
 #include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
-#include "llvm/ExecutionEngine/SectionMemoryManager.h"
-#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/BuiltinGCs.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
 #include "llvm/IR/Verifier.h"
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Target/TargetOptions.h>
 #include <llvm/Target/TargetMachine.h>
-#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include <llvm/Transforms/Scalar/SimplifyCFG.h>
+
+#include <zlib.h>
 
 #ifdef _WIN32
 #include <llvm/Support/TargetRegistry.h>
@@ -37,7 +58,11 @@
 #include "info.h"
 
 #include "reader.cpp"
+#include "jar.cpp"
+#include "registry.cpp"
 #include "njvm.cpp"
+#include "heap.cpp"
+#include "archive.cpp"
 #include "jit.cpp"
 #include "interpreter.cpp"
 
@@ -55,26 +80,160 @@ NType *make_primitive(NType::BaseType ty) {
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("usage: njvm <CLASS-FILE>");
+    Options options;
+    const char *class_file = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+
+        if (arg[0] == '-' && arg[1] == 'O' && arg[2] >= '0' && arg[2] <= '3' && !arg[3]) {
+            options.opt_level = arg[2] - '0';
+        } else if (!strcmp(arg, "-dump-ir")) {
+            options.dump_ir = true;
+        } else if (!strcmp(arg, "-cache-dir") && i + 1 < argc) {
+            options.cache_dir = argv[++i];
+        } else if (!strcmp(arg, "-jobs") && i + 1 < argc) {
+            options.jobs = atoi(argv[++i]);
+        } else if (!strcmp(arg, "-precompile")) {
+            options.precompile = true;
+        } else if (!strcmp(arg, "-interpret")) {
+            options.mode = Options::MODE_INTERPRET;
+        } else if (!strcmp(arg, "-tiered")) {
+            options.mode = Options::MODE_TIERED;
+        } else if (!strcmp(arg, "-tier-threshold") && i + 1 < argc) {
+            options.tier_threshold = atoi(argv[++i]);
+        } else if (!strcmp(arg, "-main") && i + 1 < argc) {
+            options.main_class = argv[++i];
+        } else if (!strcmp(arg, "-eager")) {
+            options.eager_load = true;
+        } else if (!strcmp(arg, "-cp") && i + 1 < argc) {
+            options.class_path = argv[++i];
+        } else if (!strcmp(arg, "-Xshare:dump")) {
+            options.share = Options::SHARE_DUMP;
+        } else if (!strcmp(arg, "-Xshare:on")) {
+            options.share = Options::SHARE_ON;
+        } else if (!strcmp(arg, "-Xshare:off")) {
+            options.share = Options::SHARE_OFF;
+        } else if (!strcmp(arg, "-share-file") && i + 1 < argc) {
+            options.share_file = argv[++i];
+        } else if (!strcmp(arg, "-heap-size") && i + 1 < argc) {
+            options.heap_size = atoi(argv[++i]);
+        } else if (!strcmp(arg, "-verbose-gc")) {
+            options.verbose_gc = true;
+        } else if (arg[0] != '-' && !class_file) {
+            class_file = arg;
+        } else {
+            printf("Unknown option '%s'\n", arg);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!class_file) {
+        printf("usage: njvm [-O0|-O1|-O2|-O3] [-dump-ir] [-cache-dir <DIR>] [-jobs <N>] [-precompile] [-interpret|-tiered] [-tier-threshold <N>] [-main <CLASS>] [-eager] [-cp <PATH>] [-Xshare:dump|-Xshare:on|-Xshare:off] [-share-file <FILE>] [-heap-size <MB>] [-verbose-gc] <CLASS-FILE|JAR>");
         return EXIT_FAILURE;
     }
 
-    const char *class_file = argv[1];
+  heap.size = (u64) options.heap_size << 20;
+  heap.verbose = options.verbose_gc;
+
+  /* the archive brings its own types and symbols, so it is mapped first */
+  Class *clazz = 0;
+  if (options.share == Options::SHARE_ON) {
+    clazz = map_archive(options.share_file, class_file, &options);
+  }
 
+  if (!clazz) {
   type_bool = make_primitive(NType::BOOL);
   type_byte = make_primitive(NType::BYTE);
   type_short = make_primitive(NType::SHORT);
   type_int = make_primitive(NType::INT);
     type_long = make_primitive(NType::LONG);
     type_void = make_primitive(NType::VOID);
+  }
+
+  size_t path_length = strlen(class_file);
+  if (path_length > 4 && !strcmp(class_file + path_length - 4, ".jar")) {
+    /* stays open, the classes point into it */
+    Jar *jar = new Jar(class_file);
 
+    String main_name;
+    if (options.main_class) {
+      main_name = copy_string(to_string(options.main_class));
+      for (u16 i = 0; i < main_name.length; ++i) {
+        if (main_name.data[i] == '.') {
+          main_name.data[i] = '/';
+        }
+      }
+    } else {
+      main_name = jar->main_class();
+    }
+
+    if (!main_name.length) {
+      printf("%s: no Main-Class in the manifest, select one with -main <CLASS>\n", class_file);
+      return EXIT_FAILURE;
+    }
 
-	ClassReader cr(class_file);
-	Class *clazz = cr.read();
+    /* the other classes of the program are looked up in the jar first */
+    class_registry.add_jar(jar);
+
+    if (clazz) {
+      /* from the archive */
+    } else if (options.eager_load) {
+      Array<Class *> classes = jar->load_all(std::thread::hardware_concurrency(), class_registry.thread_arenas);
+      for (auto c: classes) {
+        class_registry.add(c);
+        if (c->name == main_name) {
+          clazz = c;
+        }
+      }
+    } else {
+      clazz = jar->load_class(main_name, class_registry.arena);
+    }
+
+    if (!clazz) {
+      printf("%s: class '%.*s' not found\n", class_file, main_name.length, main_name.data);
+      return EXIT_FAILURE;
+    }
+  } else {
+    if (!clazz) {
+      ClassReader cr(class_file, class_registry.arena);
+      clazz = cr.read();
+    }
+
+    /* classes next to the main class are found without -cp */
+    String directory = basepath(to_string(class_file));
+    if (directory.length > 1) {
+      directory.length--;
+    }
+    class_registry.add_directory(directory.length ? to_c_string(directory) : ".");
+  }
+
+  if (options.class_path) {
+    class_registry.add_class_path(options.class_path);
+  }
+  class_registry.add(clazz);
+
+  if (options.share == Options::SHARE_DUMP) {
+    dump_archive(clazz, options.share_file, class_file, &options);
+    return 0;
+  }
+
+  if (options.mode == Options::MODE_INTERPRET) {
+    interp::Interpreter interpreter(clazz, &options);
+    interpreter.run();
+  } else if (options.mode == Options::MODE_TIERED) {
+    /* hot methods are compiled in the background while the interpreter keeps going */
+    if (options.jobs < 1) {
+      options.jobs = 1;
+    }
 
-  jit::Jit jit(clazz);
-  jit.run();
+    jit::Jit jit(clazz, &options);
+    interp::Interpreter interpreter(clazz, &options, &jit);
+    interpreter.run();
+  } else {
+    jit::Jit jit(clazz, &options);
+    jit.run();
+  }
 
 	return 0;
 }
@@ -6,6 +6,126 @@ void string_println(String str) {
   printf("%.*s\n", str.length, str.data);
 }
 
+/* Static fields are stored in Field::static_value using the width of the field's
+   type, which is also how compiled code accesses them */
+s64 load_static(Field *f) {
+  void *p = &f->static_value;
+  switch (f->type->type) {
+    case NType::BOOL:
+      return *(u8 *) p;
+    case NType::BYTE:
+      return *(s8 *) p;
+    case NType::SHORT:
+      return *(s16 *) p;
+    case NType::INT:
+      return *(s32 *) p;
+    default:
+      return *(s64 *) p;
+  }
+}
+
+void store_static(Field *f, s64 value) {
+  void *p = &f->static_value;
+  switch (f->type->type) {
+    case NType::BOOL:
+      *(u8 *) p = (u8) value;
+      break;
+    case NType::BYTE:
+      *(s8 *) p = (s8) value;
+      break;
+    case NType::SHORT:
+      *(s16 *) p = (s16) value;
+      break;
+    case NType::INT:
+      *(s32 *) p = (s32) value;
+      break;
+    default:
+      *(s64 *) p = value;
+      break;
+  }
+}
+
+/* Size of an element of an array of type (TYPE_*) */
+s64 array_type_size(u8 type) {
+  switch (type) {
+    case TYPE_BOOLEAN:
+    case TYPE_BYTE:
+      return 1;
+    case TYPE_SHORT:
+      return 2;
+    case TYPE_INT:
+      return 4;
+    case TYPE_LONG:
+      return 8;
+    default:
+      printf("Array type %d not implemented\n", type);
+      exit(1);
+  }
+}
+
+/* TYPE_* of the elements of an array whose element type is element, 0 if such
+   arrays aren't supported */
+u8 array_type_of(NType *element) {
+  switch (element->type) {
+    case NType::BOOL:
+      return TYPE_BOOLEAN;
+    case NType::BYTE:
+      return TYPE_BYTE;
+    case NType::SHORT:
+      return TYPE_SHORT;
+    case NType::INT:
+      return TYPE_INT;
+    case NType::LONG:
+      return TYPE_LONG;
+    default:
+      return 0;
+  }
+}
+
+#define NJVM_VERSION "0.1.4"
+
+/* Command line settings shared by the backends */
+struct Options {
+  u8 opt_level = 2;
+  bool dump_ir = false;
+  const char *cache_dir = 0;
+  /* number of compile threads, 0 compiles on the thread calling the method */
+  u32 jobs = 0;
+  bool precompile = false;
+
+  enum Mode {
+    MODE_JIT,
+    MODE_INTERPRET,
+    MODE_TIERED,
+  };
+
+  Mode mode = MODE_JIT;
+  /* calls + loop back edges after which the tiered mode compiles a method */
+  u32 tier_threshold = 1000;
+
+  /* class to run from a jar, instead of the Main-Class of its manifest */
+  const char *main_class = 0;
+  /* parse all classes of a jar up front (in parallel) instead of on demand */
+  bool eager_load = false;
+  /* directories and jars other classes are loaded from, see ClassRegistry */
+  const char *class_path = 0;
+
+  /* class data sharing, see archive.cpp */
+  enum Share {
+    SHARE_OFF,
+    SHARE_DUMP,
+    SHARE_ON,
+  };
+
+  Share share = SHARE_OFF;
+  const char *share_file = "njvm.jsa";
+
+  /* in MB, see Heap */
+  u32 heap_size = 1024;
+  /* print every garbage collection */
+  bool verbose_gc = false;
+};
+
 struct Backend {
   u8 inst_types[220];
   Method *method;
@@ -28,99 +148,154 @@ struct Backend {
 
   virtual void run() = 0;
 
-  Field *find_field(String class_name, String name) {
-    if (class_name != clazz->name) {
-      return 0;
+  /* Member of another class, which is loaded if it wasn't yet. The class isn't
+     initialized, that happens on its first active use. */
+  Field *find_field(String class_name, String name, String descriptor) {
+    Class *c = class_name == clazz->name ? clazz : class_registry.find(class_name);
+    return c ? c->find_field(name, descriptor) : 0;
+  }
+
+  Method *find_method(String class_name, String name, String descriptor) {
+    Class *c = class_name == clazz->name ? clazz : class_registry.find(class_name);
+    return c ? c->find_method(name, descriptor) : 0;
+  }
+
+  /* public static void main(String[]) of the current class */
+  Method *find_main() {
+    Method *m = clazz->find_method(to_string("main"), to_string("([Ljava/lang/String;)V"));
+    if (!m) {
+      printf("Can't find method 'main'\n");
+      exit(1);
     }
+    return m;
+  }
 
-    for (u16 i = 0; i < clazz->fields_count; ++i) {
-      Field *f = &clazz->fields[i];
-      if (f->name == name) {
-        return f;
+  /* Finds the attribute called name among the count undecoded attributes at
+     data, whose names are in the constant pool of c */
+  bool find_attribute(Class *c, u8 *data, u16 count, const char *name, Attribute *attribute) {
+    Reader r(data, UINT32_MAX);
+    for (u16 i = 0; i < count; ++i) {
+      attribute->name = c->constant_pool[r.read_u16() - 1].utf8;
+      attribute->attribute_length = r.read_u32();
+      attribute->info = r.read_bytes(attribute->attribute_length);
+
+      if (attribute->name == name) {
+        return true;
       }
     }
-
-    return 0;
+    return false;
   }
 
-  Method *find_method(String class_name, String name) {
-    if (class_name != clazz->name) {
-      return 0;
+  /* Decodes the Code attribute of m the first time the method is needed. The
+     interpreter and compile threads may ask at the same time, code is set last */
+  Code find_code(Method *m) {
+    if (std::atomic_ref<u8 *>(m->code.code).load(std::memory_order_acquire)) {
+      return m->code;
     }
 
-    for (u16 i = 0; i < clazz->methods_count; ++i) {
-      Method *m = &clazz->methods[i];
-      if (m->name == name) {
-        return m;
-      }
+    static std::mutex code_lock;
+    std::lock_guard<std::mutex> guard(code_lock);
+    if (m->code.code) {
+      return m->code;
     }
 
-    return 0;
-  }
-
-  Method *find_method(String name) {
-    for (u16 i = 0; i < clazz->methods_count; ++i) {
-      Method *m = &clazz->methods[i];
-      if (m->name == name) {
-        return m;
-      }
+    Attribute a;
+    if (!find_attribute(m->clazz, m->attributes, m->attributes_count, "Code", &a)) {
+      return m->code;
     }
 
-    printf("Can't find function %.*s\n", name.length, name.data);
-    return 0;
+    Reader r(a.info, a.attribute_length);
+    Code info;
+    info.max_stack = r.read_u16();
+    info.max_locals = r.read_u16();
+    info.code_length = r.read_u32();
+    info.code = r.read_bytes(info.code_length);
+    info.exception_table_length = r.read_u16();
+    info.exception_table = r.read_bytes(info.exception_table_length * 8);
+    info.attributes_count = r.read_u16();
+    info.attributes = r.bytes + r.pos;
+
+    m->code.max_stack = info.max_stack;
+    m->code.max_locals = info.max_locals;
+    m->code.code_length = info.code_length;
+    m->code.exception_table_length = info.exception_table_length;
+    m->code.exception_table = info.exception_table;
+    m->code.attributes_count = info.attributes_count;
+    m->code.attributes = info.attributes;
+    std::atomic_ref<u8 *>(m->code.code).store(info.code, std::memory_order_release);
+    return info;
   }
 
-  /* Finds class in current class only */
-  Method *find_method(const char *mname) {
-    for (u16 i = 0; i < clazz->methods_count; ++i) {
-      Method *m = &clazz->methods[i];
+  CP_Info &get_cp_info(u16 index) {
+    return clazz->constant_pool[index - 1];
+  }
 
-      if (m->name == mname) {
-        return m;
-      }
-    }
+  CP_Info &get_class_name(u16 class_index) {
+    return get_cp_info(get_cp_info(class_index).name_index);
+  }
 
-    printf("Can't find method '%s'\n", mname);
-    return 0;
+  CP_Info &get_member_name(u16 name_and_type_index) {
+    return get_cp_info(get_cp_info(name_and_type_index).name_index);
   }
 
-  Code find_code(Method *m) {
-    if (m->code.code != 0)
-      return m->code;
+  CP_Info &get_member_descriptor(u16 name_and_type_index) {
+    return get_cp_info(get_cp_info(name_and_type_index).descriptor_index);
+  }
 
-    Code info;
+  /* Entries of the constant pool are resolved once, after that they are a load
+     from Class::resolved. Resolving always gives the same result, so threads
+     racing on an entry just store the same pointer. Entries that don't resolve
+     (classes of the JDK the VM fakes) stay 0 and are resolved again. */
+  void *get_resolved(u16 index) {
+    return std::atomic_ref<void *>(clazz->resolved[index - 1]).load(std::memory_order_acquire);
+  }
 
-    for (u16 i = 0; i < m->attributes_count; ++i) {
-      Attribute *a = &m->attributes[i];
-      if (a->name == "Code") {
-        Reader r(a->info, a->attribute_length);
-        info.max_stack = r.read_u16();
-        info.max_locals = r.read_u16();
-        info.code_length = r.read_u32();
-
-        info.code = (u8 *) malloc(info.code_length);
-        for (u32 i = 0; i < info.code_length; ++i) {
-          info.code[i] = r.read_u8();
-        }
-      }
+  void set_resolved(u16 index, void *entry) {
+    std::atomic_ref<void *>(clazz->resolved[index - 1]).store(entry, std::memory_order_release);
+  }
+
+  Field *resolve_field(u16 index) {
+    Field *f = (Field *) get_resolved(index);
+    if (!f) {
+      CP_Info &ref = get_cp_info(index);
+      f = find_field(get_class_name(ref.class_index).utf8, get_member_name(ref.name_and_type_index).utf8, get_member_descriptor(ref.name_and_type_index).utf8);
+      set_resolved(index, f);
     }
+    return f;
+  }
 
-    m->code = info;
-    return info;
+  Method *resolve_method(u16 index) {
+    Method *m = (Method *) get_resolved(index);
+    if (!m) {
+      CP_Info &ref = get_cp_info(index);
+      m = find_method(get_class_name(ref.class_index).utf8, get_member_name(ref.name_and_type_index).utf8, get_member_descriptor(ref.name_and_type_index).utf8);
+      set_resolved(index, m);
+    }
+    return m;
   }
 
-  CP_Info get_cp_info(u16 index) {
-    return clazz->constant_pool[index - 1];
+  Class *resolve_class(u16 index) {
+    Class *c = (Class *) get_resolved(index);
+    if (!c) {
+      String name = get_cp_info(get_cp_info(index).name_index).utf8;
+      c = name == clazz->name ? clazz : class_registry.find(name);
+      set_resolved(index, c);
+    }
+    return c;
   }
 
-  CP_Info get_class_name(u16 class_index) {
-    CP_Info ci = get_cp_info(class_index);
-    return get_cp_info(ci.name_index);
+  /* Whether the Methodref/Fieldref at index names class_name.member_name */
+  bool is_member_ref(u16 index, const char *class_name, const char *member_name) {
+    CP_Info &ref = get_cp_info(index);
+    return get_class_name(ref.class_index).utf8 == class_name && get_member_name(ref.name_and_type_index).utf8 == member_name;
   }
 
-  CP_Info get_member_name(u16 name_and_type_index) {
-    CP_Info ci = get_cp_info(name_and_type_index);
-    return get_cp_info(ci.name_index);
+  void unresolved_method(u16 index) {
+    CP_Info &ref = get_cp_info(index);
+    String class_name = get_class_name(ref.class_index).utf8;
+    String member_name = get_member_name(ref.name_and_type_index).utf8;
+    printf("Can't find method %.*s.%.*s\n", class_name.length, class_name.data, member_name.length, member_name.data);
+    exit(1);
   }
 
   u8 fetch_u8() {
@@ -9,7 +9,11 @@ struct Reader {
     this->pos = 0;
   }
 
+  /* The file stays loaded for the lifetime of the program, the strings and
+     attributes of the class point into it. On POSIX it is mapped read-only
+     instead of copied into the heap. */
   Reader(const char *file_name) {
+#ifdef _WIN32
     FILE *f = fopen(file_name, "rb");
     if (!f) {
       printf("Failed to open file '%s'\n", file_name);
@@ -24,10 +28,40 @@ struct Reader {
     fread(bytes, sizeof(u8), length, f);
 
     fclose(f);
+#else
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+      printf("Failed to open file '%s'\n", file_name);
+      exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+      printf("Failed to read file '%s'\n", file_name);
+      exit(1);
+    }
+    length = st.st_size;
+
+    bytes = (u8 *) mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (bytes == MAP_FAILED) {
+      printf("Failed to map file '%s'\n", file_name);
+      exit(1);
+    }
+
+    close(fd);
+#endif
 
     pos = 0;
   }
 
+  /* Returns length bytes at the current position without copying them */
+  u8 *read_bytes(u32 count) {
+    assert(count <= length - pos);
+    u8 *p = &bytes[pos];
+    pos += count;
+    return p;
+  }
+
   u8 read_u8() {
     assert(pos < length);
     return bytes[pos++];
@@ -59,6 +93,21 @@ struct Reader {
     return c;
   }
 
+  /* zip archives store their fields little endian */
+  u16 read_u16_le() {
+    assert(pos + 2 <= length);
+    u16 v = bytes[pos] | (bytes[pos + 1] << 8);
+    pos += 2;
+    return v;
+  }
+
+  u32 read_u32_le() {
+    assert(pos + 4 <= length);
+    u32 v = bytes[pos] | (bytes[pos + 1] << 8) | (bytes[pos + 2] << 16) | ((u32) bytes[pos + 3] << 24);
+    pos += 4;
+    return v;
+  }
+
   u32 read_u64() {
     assert(pos < length - 7);
     u64 *p = (u64 *) &bytes[pos];
@@ -79,14 +128,119 @@ struct Reader {
   }
 };
 
+/* Every distinct descriptor is parsed once, classes share the NType of equal
+   descriptors (and the element and parameter types inside them), so equal
+   types are the same pointer. Types aren't owned by a class loader since they
+   are shared between them. */
+struct Type_Table {
+  /* keys point into interned descriptors, which are never freed */
+  Hash_Table<NType *> types;
+  Arena arena;
+  std::mutex lock;
+
+  NType *get(String descriptor) {
+    std::lock_guard<std::mutex> guard(lock);
+    return parse(descriptor);
+  }
+
+  NType *parse(String descriptor) {
+    NType **cached = types.find(descriptor);
+    if (cached) {
+      return *cached;
+    }
+
+    NType *ty;
+    u8 c = descriptor.data[0];
+    if (c == '(') {
+      ty = arena.make<NType>();
+      ty->type = NType::FUNCTION;
+
+      NType *parameters[255];
+      u16 count = 0;
+      u16 i = 1;
+      while (descriptor.data[i] != ')') {
+        u16 length = component_length(descriptor, i);
+        parameters[count++] = parse(descriptor.substring(i, length));
+        i += length;
+      }
+      i++;
+      ty->return_type = parse(descriptor.substring(i, descriptor.length - i));
+
+      ty->parameters.data = arena.allocate_array<NType *>(count);
+      ty->parameters.length = count;
+      memcpy(ty->parameters.data, parameters, count * sizeof(NType *));
+    } else if (c == 'L') {
+      ty = arena.make<NType>();
+      ty->type = NType::CLASS;
+      ty->clazz_name = intern(descriptor.substring(1, descriptor.length - 2));
+    } else if (c == '[') {
+      ty = arena.make<NType>();
+      ty->type = NType::ARRAY;
+      ty->element_type = parse(descriptor.substring(1, descriptor.length - 1));
+    } else {
+      switch (c) {
+        case 'V':
+          ty = type_void;
+          break;
+        case 'Z':
+          ty = type_bool;
+          break;
+        case 'B':
+          ty = type_byte;
+          break;
+        case 'S':
+          ty = type_short;
+          break;
+        case 'I':
+          ty = type_int;
+          break;
+        case 'J':
+          ty = type_long;
+          break;
+        default: {
+          printf("Unknown type '%c'\n", c);
+          return type_void;
+        };
+      }
+    }
+
+    types.insert(descriptor, ty);
+    return ty;
+  }
+
+  /* Length of the field descriptor starting at start */
+  static u16 component_length(String descriptor, u16 start) {
+    u16 end = start;
+    while (descriptor.data[end] == '[') {
+      end++;
+    }
+    if (descriptor.data[end] == 'L') {
+      while (descriptor.data[end] != ';') {
+        end++;
+      }
+    }
+    return end - start + 1;
+  }
+};
+
+Type_Table type_table;
+
+/* Everything read for a class (the Class itself, its constant pool and members)
+   is allocated from the arena of the loader */
 struct ClassReader {
   CP_Info *cp;
   Reader *r;
+  Arena *arena;
 
-  ClassReader(const char *file_name) {
+  ClassReader(const char *file_name, Arena *arena) : arena(arena) {
     r = new Reader(file_name);
   }
 
+  /* bytes has to stay alive as long as the class, nothing is copied out of it */
+  ClassReader(u8 *bytes, u32 length, Arena *arena) : arena(arena) {
+    r = new Reader(bytes, length);
+  }
+
   String read_name() {
     u16 index = r->read_u16();
     CP_Info cpi = cp[index - 1];
@@ -126,11 +280,8 @@ struct ClassReader {
         String utf8;
 
         utf8.length = r->read_u16();
-        utf8.data = (u8 *) malloc(utf8.length);
-        for (u16 i = 0; i < utf8.length; ++i) {
-          utf8.data[i] = r->read_u8();
-        }
-        info.utf8 = utf8;
+        utf8.data = r->read_bytes(utf8.length);
+        info.utf8 = intern(utf8);
       }
         break;
       case CONSTANT_String: {
@@ -138,7 +289,8 @@ struct ClassReader {
       }
         break;
       case CONSTANT_Integer: {
-        info.long_int = r->read_u32();
+        /* sign extended, LDC pushes it as a long */
+        info.long_int = (s32) r->read_u32();
       }
         break;
       case CONSTANT_Long: {
@@ -153,18 +305,16 @@ struct ClassReader {
     return info;
   }
 
-  Attribute read_attribute() {
-    Attribute info;
-
-    info.name = read_name();
-    info.attribute_length = r->read_u32();
-
-    info.info = (u8 *) malloc(info.attribute_length);
-    for (u16 i = 0; i < info.attribute_length; ++i) {
-      info.info[i] = r->read_u8();
+  /* Attributes are only stepped over when the class is read, they are decoded
+     straight from the class data when they are needed */
+  u8 *skip_attributes(u16 count) {
+    u8 *start = r->bytes + r->pos;
+    for (u16 i = 0; i < count; ++i) {
+      r->pos += 2;
+      u32 length = r->read_u32();
+      r->read_bytes(length);
     }
-
-    return info;
+    return start;
   }
 
   Field read_field() {
@@ -172,13 +322,10 @@ struct ClassReader {
 
     info.access_flags = r->read_u16();
     info.name = read_name();
-    info.type = read_type();
+    info.descriptor = read_name();
+    info.type = type_table.get(info.descriptor);
     info.attributes_count = r->read_u16();
-
-    info.attributes = (Attribute *) malloc(info.attributes_count * sizeof(Attribute));
-    for (u16 i = 0; i < info.attributes_count; ++i) {
-      info.attributes[i] = read_attribute();
-    }
+    info.attributes = skip_attributes(info.attributes_count);
 
     return info;
   }
@@ -188,13 +335,11 @@ struct ClassReader {
 
     info.access_flags = r->read_u16();
     info.name = read_name();
-    info.type = read_type();
+    info.descriptor = read_name();
+    info.type = type_table.get(info.descriptor);
 
     info.attributes_count = r->read_u16();
-    info.attributes = (Attribute *) malloc(info.attributes_count * sizeof(Attribute));
-    for (u16 i = 0; i < info.attributes_count; ++i) {
-      info.attributes[i] = read_attribute();
-    }
+    info.attributes = skip_attributes(info.attributes_count);
 
     return info;
   }
@@ -206,17 +351,19 @@ struct ClassReader {
       exit(1);
     }
 
-    Class *clazz = new Class();
+    Class *clazz = arena->make<Class>();
+    clazz->hash = hash_bytes(r->bytes, r->length);
 
     u16 minor_version = r->read_u16();
     u16 major_version = r->read_u16();
 
     clazz->constant_pool_count = r->read_u16();
-    clazz->constant_pool = (CP_Info *) malloc(sizeof(CP_Info) * (clazz->constant_pool_count - 1));
+    clazz->constant_pool = arena->allocate_array<CP_Info>(clazz->constant_pool_count - 1);
     for (u16 i = 0; i < clazz->constant_pool_count - 1; ++i) {
       clazz->constant_pool[i] = read_cp_info();
     }
     cp = clazz->constant_pool;
+    clazz->resolved = arena->allocate_array<void *>(clazz->constant_pool_count - 1);
 
     clazz->access_flags = r->read_u16();
     clazz->name = read_class_name();
@@ -228,22 +375,23 @@ struct ClassReader {
     }
 
     clazz->fields_count = r->read_u16();
-    clazz->fields = (Field *) malloc(sizeof(Field) * clazz->fields_count);
+    clazz->fields = arena->allocate_array<Field>(clazz->fields_count);
     for (u16 i = 0; i < clazz->fields_count; ++i) {
       clazz->fields[i] = read_field();
+      clazz->fields[i].clazz = clazz;
     }
 
     clazz->methods_count = r->read_u16();
-    clazz->methods = (Method *) malloc(sizeof(Method) * clazz->methods_count);
+    clazz->methods = arena->allocate_array<Method>(clazz->methods_count);
     for (u16 i = 0; i < clazz->methods_count; ++i) {
       clazz->methods[i] = read_method();
       clazz->methods[i].clazz = clazz;
     }
 
-    u16 attributes_count = r->read_u16();
-    for (u16 i = 0; i < attributes_count; ++i) {
-      read_attribute();
-    }
+    clazz->field_index.build(clazz->fields, clazz->fields_count, arena);
+    clazz->method_index.build(clazz->methods, clazz->methods_count, arena);
+
+    skip_attributes(r->read_u16());
 
     return clazz;
   }
@@ -251,82 +399,4 @@ struct ClassReader {
   ~ClassReader() {
     delete r;
   }
-
-  NType *read_type() {
-    String str = read_name();
-    return parse_type(str);
-  }
-
-  NType *parse_type(String str) {
-    u8 first = str.data[0];
-
-    if (first == '(') {
-      NType *ty = new NType();
-      ty->type = NType::FUNCTION;
-
-      u16 i = 1;
-      while (str.data[i] != ')') {
-        ty->parameters.add(parse_type(str, &i));
-      }
-      i++;
-      ty->return_type = parse_type(str, &i);
-
-      return ty;
-    } else {
-      return parse_type(str, 0);
-    }
-  }
-
-  NType *parse_type(String str, u16 *i) {
-    u16 start = i ? *i : 0;
-    u8 c = str.data[start];
-
-    if (c == 'L') {
-      u16 len = 0;
-      u16 p = start + 1;
-      String s;
-
-      c = str.data[p];
-      while (c != ';') {
-        c = str.data[++p];
-        len++;
-      }
-
-      (*i) += len + 2; /* 2 -> L and ;*/
-
-      NType *ty = new NType();
-      ty->type = NType::CLASS;
-      ty->clazz_name = str.substring(start + 1, len);
-      return ty;
-    } else if (c == '[') {
-      (*i)++;
-      NType *ty = new NType();
-      ty->type = NType::ARRAY;
-      ty->element_type = parse_type(str, i);
-      return ty;
-    } else {
-      if (i) {
-        (*i)++;
-      }
-      switch (c) {
-        case 'V':
-          return type_void;
-        case 'Z':
-          return type_bool;
-        case 'B':
-          return type_byte;
-        case 'S':
-          return type_short;
-        case 'I':
-          return type_int;
-        case 'J':
-          return type_long;
-        default: {
-          printf("Unknown type '%c'\n", c);
-        };
-      }
-    }
-
-    return type_void;
-  }
 };
\ No newline at end of file
@@ -0,0 +1,160 @@
+#ifdef _WIN32
+#define CLASS_PATH_SEPARATOR ';'
+#else
+#define CLASS_PATH_SEPARATOR ':'
+#endif
+
+struct Class_Path_Entry {
+  /* exactly one of them is set */
+  const char *directory;
+  Jar *jar;
+};
+
+/* All classes of the program by name. A class is loaded from the class path the
+   first time something resolves a reference to it, from then on (and for names
+   that weren't found) resolving it is a single hash lookup. */
+struct ClassRegistry {
+  Hash_Table<Class *> classes;
+  /* in load order */
+  Array<Class *> loaded;
+  Array<Class_Path_Entry> class_path;
+
+  /* Runs a <clinit>, set by the interpreter or the JIT, whichever executes the
+     program */
+  std::function<void(Method *)> run_initializer;
+  /* Called for every class once it is registered */
+  std::function<void(Class *)> on_load;
+
+  /* The registry is the class loader of the program and owns the memory of
+     the classes it loaded, see ClassReader. Classes parsed in parallel come
+     from one arena per thread. The arenas are never released, classes can't
+     be unloaded and compile threads may still run while the program exits. */
+  Arena *arena = new Arena();
+  Array<Arena *> thread_arenas;
+
+  /* Compile threads resolve classes while translating. Registering a class with
+     the JIT may translate code on the same thread, so the lock is recursive. */
+  std::recursive_mutex lock;
+
+  /* Adds the entries of a class path, directories and jars separated by ':'
+     (';' on Windows) */
+  void add_class_path(const char *path) {
+    while (*path) {
+      const char *end = strchr(path, CLASS_PATH_SEPARATOR);
+      size_t length = end ? end - path : strlen(path);
+
+      if (length) {
+        char *entry = (char *) malloc(length + 1);
+        memcpy(entry, path, length);
+        entry[length] = 0;
+
+        if (length > 4 && !strcmp(entry + length - 4, ".jar")) {
+          add_jar(new Jar(entry));
+        } else {
+          add_directory(entry);
+        }
+      }
+
+      path += length;
+      if (*path) {
+        path++;
+      }
+    }
+  }
+
+  void add_directory(const char *directory) {
+    Class_Path_Entry e;
+    e.directory = directory;
+    e.jar = 0;
+    class_path.add(e);
+  }
+
+  void add_jar(Jar *jar) {
+    Class_Path_Entry e;
+    e.directory = 0;
+    e.jar = jar;
+    class_path.add(e);
+  }
+
+  void add(Class *clazz) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    Class **existing = classes.find(clazz->name);
+    if (existing && *existing) {
+      return;
+    }
+
+    classes.insert(clazz->name, clazz);
+    loaded.add(clazz);
+    if (on_load) {
+      on_load(clazz);
+    }
+  }
+
+  /* name in internal form, e.g. java/lang/Object */
+  Class *find(String name) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    Class **c = classes.find(name);
+    if (c) {
+      return *c;
+    }
+
+    Class *clazz = load(name);
+    if (clazz) {
+      add(clazz);
+    } else {
+      classes.insert(intern(name), 0);
+    }
+    return clazz;
+  }
+
+  Class *load(String name) {
+    for (auto &e: class_path) {
+      if (e.jar) {
+        Class *c = e.jar->load_class(name, arena);
+        if (c) {
+          return c;
+        }
+        continue;
+      }
+
+      /* <directory>/<name>.class */
+      u64 length = strlen(e.directory) + name.length + 8;
+      char *file_name = (char *) malloc(length);
+      snprintf(file_name, length, "%s/%.*s.class", e.directory, name.length, name.data);
+
+      FILE *f = fopen(file_name, "rb");
+      if (f) {
+        fclose(f);
+        Class *c;
+        {
+          ClassReader cr(file_name, arena);
+          c = cr.read();
+        }
+        free(file_name);
+        return c;
+      }
+      free(file_name);
+    }
+
+    return 0;
+  }
+
+  /* Runs the <clinit> of clazz unless it already ran or is running. Only the
+     thread executing the program initializes classes, so no locking. */
+  void initialize(Class *clazz) {
+    if (clazz->init_state != Class::UNINITIALIZED) {
+      return;
+    }
+
+    clazz->init_state = Class::INITIALIZING;
+    Method *m = clazz->find_method(to_string("<clinit>"), to_string("()V"));
+    if (m) {
+      run_initializer(m);
+    }
+    clazz->init_state = Class::INITIALIZED;
+  }
+};
+
+ClassRegistry class_registry;